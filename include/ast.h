@@ -1,7 +1,11 @@
 #pragma once
 #include <string>
 #include <vector>
+#include <cstdint>
 #include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include <variant>
 
 // Arena allocator for efficient memory management
@@ -10,14 +14,34 @@ class Arena {
         Arena(size_t block_size = 4096);
         ~Arena();
     
+        // Returns max_align_t-aligned memory; requests larger than a block
+        // get a dedicated allocation.
         void* allocate(size_t size);
+        // Frees every object and keeps the blocks for the next use
         void reset();
     
+        // Constructs a T in the arena. Its destructor runs at reset() or when
+        // the arena dies, so nodes owning strings or vectors do not leak when
+        // one arena serves many compiles.
+        template<typename T, typename... Args>
+        T* create(Args&&... args) {
+            T* object = new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                destructors.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+            }
+            return object;
+        }
+    
     private:
         size_t block_size;
         std::vector<char*> blocks;
+        std::vector<char*> large_blocks;
+        size_t block_index;
         char* current_block;
         size_t offset;
+        std::vector<std::pair<void*, void (*)(void*)>> destructors;
+    
+        void destroy_objects();
 };
 
 // Type system
@@ -25,11 +49,26 @@ enum class Type {
     INT,
     FLOAT,
     VEC,
+    MAT,
+    SVEC,
     UNKNOWN
 };
 
 std::string type_to_string(Type t);
 
+// Static shape of a vec or svec (rows = length, cols = 1) or mat value; known is
+// false when the type checker cannot tell the size at compile time
+struct Shape {
+    size_t rows;
+    size_t cols;
+    bool known;
+    
+    Shape() : rows(0), cols(0), known(false) {}
+    Shape(size_t r, size_t c) : rows(r), cols(c), known(true) {}
+};
+
+std::string shape_to_string(Type t, const Shape& s);
+
 // AST Node types
 enum class NodeType {
     PROGRAM,
@@ -38,16 +77,24 @@ enum class NodeType {
     LITERAL_INT,
     LITERAL_FLOAT,
     LITERAL_VEC,
+    LITERAL_MAT,
     IDENTIFIER,
-    PRINT_STMT
+    PRINT_STMT,
+    INPUT_DECL,
+    LITERAL_SVEC,
+    CALL,
+    SLICE,
+    FN_DECL
 };
 
 // Base AST Node
 struct ASTNode {
     NodeType node_type;
     Type type;
+    Shape shape; // filled in by the type checker for vec and mat values
+    int line; // source line of the token that starts the node, 0 if unknown
     
-    ASTNode(NodeType nt) : node_type(nt), type(Type::UNKNOWN) {}
+    ASTNode(NodeType nt) : node_type(nt), type(Type::UNKNOWN), line(0) {}
     virtual ~ASTNode() = default;
 };
 
@@ -66,13 +113,39 @@ struct LiteralFloat : ASTNode {
     }
 };
 
+// Elements live in a buffer owned by the parser's arena
 struct LiteralVec : ASTNode {
-    std::vector<float> values;
-    LiteralVec(std::vector<float> v) : ASTNode(NodeType::LITERAL_VEC), values(v) {
+    float* values;
+    size_t size;
+    LiteralVec(float* v, size_t n) : ASTNode(NodeType::LITERAL_VEC), values(v), size(n) {
         type = Type::VEC;
     }
 };
 
+// Row-major elements, rows * cols floats in the parser's arena
+struct LiteralMat : ASTNode {
+    float* values;
+    size_t rows;
+    size_t cols;
+    LiteralMat(float* v, size_t r, size_t c)
+        : ASTNode(NodeType::LITERAL_MAT), values(v), rows(r), cols(c) {
+        type = Type::MAT;
+    }
+};
+
+// {size | index: value, ...}: nnz entries sorted by strictly increasing
+// index, both arrays in the parser's arena
+struct LiteralSVec : ASTNode {
+    uint32_t* indices;
+    float* values;
+    size_t nnz;
+    size_t size;
+    LiteralSVec(uint32_t* i, float* v, size_t n, size_t s)
+        : ASTNode(NodeType::LITERAL_SVEC), indices(i), values(v), nnz(n), size(s) {
+        type = Type::SVEC;
+    }
+};
+
 struct Identifier : ASTNode {
     std::string name;
     Identifier(std::string n) : ASTNode(NodeType::IDENTIFIER), name(n) {}
@@ -87,6 +160,50 @@ struct BinaryOp : ASTNode {
         : ASTNode(NodeType::BINARY_OP), op(o), left(l), right(r) {}
 };
 
+struct FnDecl;
+
+// Call of a builtin function, e.g. dense(s), or of a fn; for a fn the type
+// checker sets which of its specialisations the call uses
+struct Call : ASTNode {
+    std::string name;
+    std::vector<ASTNode*> args;
+    FnDecl* fn = nullptr;
+    size_t specialisation = 0;
+    
+    Call(std::string n, std::vector<ASTNode*> a)
+        : ASTNode(NodeType::CALL), name(n), args(std::move(a)) {}
+};
+
+// vec[start:stop:step]: a view of every step-th element in [start, stop)
+// that shares the vec's storage. Omitted bounds are null and default to 0,
+// the length and 1. When the type checker can prove the bounds it sets
+// static_bounds and the resolved first element, count and step.
+struct Slice : ASTNode {
+    ASTNode* vec;
+    ASTNode* start;
+    ASTNode* stop;
+    ASTNode* step;
+    bool static_bounds = false;
+    size_t first = 0;
+    size_t count = 0;
+    size_t stride = 1;
+    
+    Slice(ASTNode* v, ASTNode* a, ASTNode* b, ASTNode* s)
+        : ASTNode(NodeType::SLICE), vec(v), start(a), stop(b), step(s) {}
+    
+    // The vec, then whichever bounds are present
+    size_t operand_count() const {
+        return 1 + (start != nullptr) + (stop != nullptr) + (step != nullptr);
+    }
+    ASTNode*& operand(size_t i) {
+        ASTNode** slots[4] = {&vec, &start, &stop, &step};
+        for (ASTNode** slot : slots) {
+            if (*slot && i-- == 0) return *slot;
+        }
+        return vec;
+    }
+};
+
 struct VarDecl : ASTNode {
     std::string name;
     Type var_type;
@@ -96,6 +213,42 @@ struct VarDecl : ASTNode {
         : ASTNode(NodeType::VAR_DECL), name(n), var_type(t), initializer(init) {}
 };
 
+// input name: type -- a per-record value supplied at run time (batch mode);
+// vec and mat inputs carry their fixed shape
+struct InputDecl : ASTNode {
+    std::string name;
+    Type var_type;
+    
+    InputDecl(std::string n, Type t, Shape s)
+        : ASTNode(NodeType::INPUT_DECL), name(n), var_type(t) {
+        shape = s;
+    }
+};
+
+// fn name(param: type, ...) = body -- an element-wise kernel over int,
+// float and vec parameters. A float parameter also takes a vec, and the
+// body is then applied to each of its elements. The type checker types a
+// copy of the body for each combination of argument types it is called with.
+struct FnDecl : ASTNode {
+    struct Param {
+        std::string name;
+        Type type;
+    };
+    struct Specialisation {
+        std::vector<Type> types; // per parameter: int, float, or vec for element-wise
+        ASTNode* body;           // typed copy of the body
+        bool elementwise;        // some parameter is a vec
+    };
+    
+    std::string name;
+    std::vector<Param> params;
+    ASTNode* body;
+    std::vector<Specialisation> specialisations;
+    
+    FnDecl(std::string n, std::vector<Param> p, ASTNode* b)
+        : ASTNode(NodeType::FN_DECL), name(n), params(std::move(p)), body(b) {}
+};
+
 struct PrintStmt : ASTNode {
     ASTNode* expr;
     
@@ -106,4 +259,55 @@ struct Program : ASTNode {
     std::vector<ASTNode*> statements;
     
     Program() : ASTNode(NodeType::PROGRAM) {}
-};
\ No newline at end of file
+};
+
+// Operands of a node in evaluation order (statements expose their expression)
+inline size_t child_count(const ASTNode* node) {
+    switch (node->node_type) {
+        case NodeType::BINARY_OP: return 2;
+        case NodeType::VAR_DECL: return 1;
+        case NodeType::PRINT_STMT: return 1;
+        case NodeType::CALL: return static_cast<const Call*>(node)->args.size();
+        case NodeType::SLICE: return static_cast<const Slice*>(node)->operand_count();
+        default: return 0;
+    }
+}
+
+inline ASTNode*& child(ASTNode* node, size_t i) {
+    switch (node->node_type) {
+        case NodeType::BINARY_OP: {
+            BinaryOp* binop = static_cast<BinaryOp*>(node);
+            return i == 0 ? binop->left : binop->right;
+        }
+        case NodeType::VAR_DECL: return static_cast<VarDecl*>(node)->initializer;
+        case NodeType::CALL: return static_cast<Call*>(node)->args[i];
+        case NodeType::SLICE: return static_cast<Slice*>(node)->operand(i);
+        default: return static_cast<PrintStmt*>(node)->expr;
+    }
+}
+
+// Post-order walk with an explicit stack, so arbitrarily deep expressions
+// cannot overflow the call stack. fn receives the slot holding each node and
+// may replace it; children are visited (and possibly replaced) first.
+template<typename F>
+void visit_postorder(ASTNode*& root, F&& fn) {
+    struct Frame {
+        ASTNode** slot;
+        size_t next_child;
+    };
+    std::vector<Frame> stack;
+    stack.push_back({&root, 0});
+    
+    while (!stack.empty()) {
+        Frame& frame = stack.back();
+        ASTNode* node = *frame.slot;
+        if (frame.next_child < child_count(node)) {
+            ASTNode** slot = &child(node, frame.next_child++);
+            stack.push_back({slot, 0});
+        } else {
+            ASTNode** slot = frame.slot;
+            stack.pop_back();
+            fn(*slot);
+        }
+    }
+}
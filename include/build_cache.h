@@ -0,0 +1,52 @@
+#pragma once
+#include "options.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Files shared by the compiles of one mmlc daemon, kept in a private
+// directory that is removed with the cache:
+//  - one precompiled header per distinct runtime and backend flags, so a
+//    compile only parses and optimises the runtime once
+//  - the outputs of successful compiles keyed by source and options, so a
+//    repeated compile copies the earlier result instead of running g++
+// All members may be called from several threads at once.
+class BuildCache {
+public:
+    explicit BuildCache(size_t max_results = 256);
+    ~BuildCache();
+    bool open(std::string& error); // creates the directory
+
+    // Header with the given runtime text, precompiled for the backend flags
+    // of options when the backend supports it
+    std::string runtime_header(const std::string& runtime, const CompilerOptions& options);
+
+    // Everything that decides the output of a compile
+    static std::string result_key(const CompilerOptions& options, const std::string& source);
+    // Copies the outputs of an earlier compile with this key; false on a miss
+    bool restore(const std::string& key, const std::string& cpp_file, const std::string& binary);
+    void store(const std::string& key, const std::string& cpp_file, const std::string& binary);
+
+private:
+    struct Header {
+        std::string path;
+        bool ready;
+    };
+    struct Result {
+        std::string cpp_file;
+        std::string binary;
+    };
+
+    std::string dir;
+    size_t max_results;
+    size_t next_file;
+    std::mutex mutex;
+    std::condition_variable header_ready;
+    std::unordered_map<std::string, Header> headers;
+    std::unordered_map<std::string, Result> results;
+    std::deque<std::string> result_order; // oldest first, evicted past max_results
+
+    std::string new_file(const std::string& suffix);
+};
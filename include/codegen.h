@@ -1,29 +1,135 @@
 #pragma once
-#include "ast.h"
+#include "emitter.h"
+#include "ir.h"
 #include <string>
-#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct CodeGenOptions {
+    // Wrap every let/print in timestamp, arena-byte and vector-element
+    // counters and dump a per-line profile when the program exits.
+    bool instrument = false;
+
+    // Run independent statements concurrently as a task graph on a
+    // work-stealing pool; prints keep their source order. Programs with
+    // inputs already run records in parallel and ignore this.
+    bool parallel = false;
+
+    // Math builtins call libm instead of the SIMD polynomial approximations
+    bool exact_math = false;
+};
 
 class CodeGen {
 public:
-    CodeGen();
-    std::string generate(Program* program);
+    CodeGen(const CodeGenOptions& options = CodeGenOptions());
+    // Streams the self-contained C++ translation of program into filename
+    bool generate(const IRProgram& program, const std::string& filename);
+    // Just the runtime the translation of program needs, as generate()
+    // emits it; it depends only on the options and which features are used
+    bool generate_runtime(const IRProgram& program, std::string& runtime);
 
 private:
-    std::stringstream output;
+    static const size_t MAX_INLINE_EXPRESSION = 256;
+
+    Emitter output;
     int temp_counter;
+    CodeGenOptions options;
+    bool uses_matrices; // only emit the matrix runtime when the program needs it
+    bool uses_sparse;   // likewise for the svec runtime
+    bool uses_math;     // and for the element-wise math builtins
+    bool uses_kernels;  // some fn is called element-wise
+    bool batch_mode;    // the program declares inputs and runs once per record
+    bool task_graph;    // --parallel on a program without inputs
+
+    // Slot kinds of one input record (0 = int32, 1 = float32), in declaration order
+    std::vector<unsigned char> input_slots;
+    size_t input_offset;
+
+    // One entry per instrumented statement, emitted as prof_sites[] after main
+    struct ProfSiteInfo {
+        int line;
+        std::string label;
+    };
+    std::vector<ProfSiteInfo> prof_sites;
+
+    // The program being lowered, the C++ code of each of its values (an
+    // expression, a temporary or a variable name) and how often each is read
+    const IRProgram* ir;
+    std::vector<std::string> values;
+    std::vector<int> value_uses;
+
+    // Vec buffer liveness. Every vec value that owns an arena buffer maps to
+    // a buffer id with a count of the uses still ahead; when it reaches zero
+    // the consuming operation writes its result in place or releases it.
+    std::unordered_map<std::string, size_t> buffer_of;   // vec value -> buffer id
+    std::vector<int> buffer_uses;
+
+    // Slices share their base's buffer id and hold one use of it, so the
+    // buffer outlives every view of it. A view covers only part of the
+    // buffer: it is never written in place and never released itself; the
+    // buffer is released through its owner, the value that spans all of it.
+    struct BufferOwner {
+        std::string name;
+        size_t task;     // statement whose task declares a temporary owner
+        bool temporary;
+    };
+    std::unordered_set<std::string> views;
+    std::vector<BufferOwner> buffer_owner;
+
+    // Task graph state: the statement being lowered, the statements that
+    // read each buffer since it was last overwritten, and the edges so far
+    size_t current_task;
+    std::vector<std::vector<size_t>> buffer_readers;
+    std::vector<std::pair<size_t, size_t>> task_edges;
 
-    void generate_statement(ASTNode* node);
-    std::string generate_expression(ASTNode* node);
+    void analyse(const IRProgram& program);
+    void generate_statement(size_t statement, size_t& next);
+    void generate_instruction(size_t id);
+    const Instruction& operand(const Instruction& inst, size_t i) const;
 
-    std::string generate_binary_op(BinaryOp* node);
+    std::string generate_binary_op(const Instruction& inst, std::string left, std::string right);
+    std::string generate_vec_op(const std::string& func, const std::string& a, const std::string& b,
+                                bool b_is_vec, bool same_size);
+    std::string generate_sparse_op(const Instruction& inst, const std::string& left, const std::string& right);
+    std::string generate_call(const Instruction& inst, const std::vector<std::string>& args);
+    std::string generate_fn_call(const Instruction& inst, const std::vector<std::string>& args);
+    std::string generate_slice(const Instruction& inst, const std::vector<std::string>& operands);
     std::string generate_literal_int(LiteralInt* node);
     std::string generate_literal_float(LiteralFloat* node);
     std::string generate_literal_vec(LiteralVec* node);
-    std::string generate_identifier(Identifier* node);
+    std::string generate_literal_mat(LiteralMat* node);
+    std::string generate_literal_svec(LiteralSVec* node);
 
-    void generate_var_decl(VarDecl* node);
-    void generate_print_stmt(PrintStmt* node);
+    void generate_let(size_t id, const std::string& init);
+    void generate_print(const Instruction& inst, const std::string& expr);
+    void generate_input(size_t id);
+    void generate_batch_main();
+    void generate_task_graph_main();
 
+    std::string cpp_type(Type type);
+    std::string spill(Type type, const std::string& code);
+    void reset_liveness();
+    std::string unused(size_t id) const;
+    void new_buffer(const std::string& value, int uses);
+    bool consume(const std::string& value);
+    void kill_buffer(size_t buffer);
+    void release_if_dead(const std::string& value);
+    void release_buffer(size_t buffer);
+    void check_lengths(const Instruction& inst, std::string& left, std::string& right);
     std::string new_temp();
     void emit_runtime();
+    void emit_thread_runtime();
+    void emit_batch_runtime();
+    void emit_task_graph_runtime();
+    void emit_simd_runtime();
+    void emit_matrix_runtime();
+    void emit_math_runtime();
+    void emit_sparse_runtime();
+    void emit_profiler_runtime();
+    void emit_profiler_sites();
+    void emit_kernels();
+    void emit_kernel(FnDecl* fn, size_t specialisation);
+    std::string generate_kernel_body(ASTNode* body);
+    void emit_elem_count(const std::string& count);
 };
\ No newline at end of file
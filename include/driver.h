@@ -0,0 +1,30 @@
+#pragma once
+#include "ast.h"
+#include "options.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+class BuildCache;
+
+// What one compile may reuse beyond its options. The command line uses the
+// defaults; the daemon passes each worker's arena and its shared cache.
+struct CompileEnvironment {
+    std::string cwd;             // relative paths resolve against it; empty = process cwd
+    Arena* arena = nullptr;      // reset and reused when given
+    BuildCache* cache = nullptr; // precompiled runtime headers
+};
+
+std::string resolve_path(const std::string& cwd, const std::string& path);
+bool read_source(const std::string& path, std::string& source, std::ostream& err);
+
+// Runs args[0], found on PATH, with args and no shell in between, so
+// paths and names reach it unchanged. What it prints on stdout and stderr
+// goes to output, or is discarded when output is null. Returns its exit
+// status, or -1 when it could not be run or was killed.
+int run_command(const std::vector<std::string>& args, std::ostream* output);
+
+// Front end, code generation and backend for one program. Progress goes to
+// out, diagnostics to err; returns the exit status for the invocation.
+int compile(const CompilerOptions& options, const std::string& source, std::ostream& out,
+            std::ostream& err, const CompileEnvironment& env = CompileEnvironment());
@@ -0,0 +1,43 @@
+#pragma once
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Buffered sink for generated code. Text is appended to a fixed-size buffer
+// that is written to the file in large chunks, so a program of any size is
+// streamed to disk with bounded memory instead of being built up in a string.
+class Emitter {
+public:
+    explicit Emitter(size_t buffer_size = 1 << 20);
+    ~Emitter();
+    
+    bool open(const std::string& filename);
+    void open_string(std::string& text); // appends to text instead of a file
+    bool close(); // flushes; false if any write failed
+    
+    Emitter& write(const char* data, size_t size);
+    
+    Emitter& operator<<(const std::string& s) { return write(s.data(), s.size()); }
+    Emitter& operator<<(const char* s) { return write(s, std::strlen(s)); }
+    Emitter& operator<<(char c) { return write(&c, 1); }
+    
+    template<typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char> &&
+                                                     !std::is_same_v<T, bool>>>
+    Emitter& operator<<(T value) {
+        char buf[24];
+        std::to_chars_result res = std::to_chars(buf, buf + sizeof(buf), value);
+        return write(buf, res.ptr - buf);
+    }
+    
+private:
+    FILE* file;
+    std::string* target;
+    std::vector<char> buffer;
+    size_t used;
+    bool failed;
+    
+    void flush();
+};
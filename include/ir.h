@@ -0,0 +1,86 @@
+#pragma once
+#include "ast.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Typed SSA form of a checked program; passes and backends work on this
+// instead of the AST. MiniMathLang has no control flow, so a program is a
+// single block: instructions in execution order, each defining at most one
+// value, identified by its index. Values are never reassigned; `let x = e`
+// becomes a LET named x whose operand is the value of e.
+
+enum class Opcode {
+    CONST, // literal; node holds the data
+    INPUT, // input declaration: one value per record
+    LET,   // names its operand; computes nothing
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    CALL,  // named by name: a builtin, or a fn, whose Call node gives the specialisation
+    SLICE, // operands: the vec, then the bounds given; node is the Slice
+    PRINT
+};
+
+// What an instruction does besides computing its value
+enum class Effect {
+    NONE,   // pure scalar computation or naming
+    ALLOC,  // the result owns fresh memory (vec, mat and svec results)
+    VIEW,   // the result aliases the memory of operand 0
+    INPUT,  // reads slots of the current input record
+    OUTPUT  // writes to the program's output
+};
+
+struct Instruction {
+    Opcode op;
+    Type type;                   // type of the result; UNKNOWN for PRINT
+    Shape shape;                 // vector length or matrix shape, when known statically
+    std::vector<size_t> operands;
+    std::string name;            // LET and INPUT: the variable; CALL: the function
+    ASTNode* node;               // CONST: the literal; SLICE: the Slice; else the source node
+    size_t statement;            // index of the source statement
+    bool removed;                // set by passes; dropped by IRProgram::compact
+
+    Instruction(Opcode op, Type type, Shape shape, size_t statement)
+        : op(op), type(type), shape(shape), node(nullptr), statement(statement), removed(false) {}
+};
+
+// Source statement an instruction came from, for per-statement code
+// (task graph tasks, profiling sites)
+struct IRStatement {
+    NodeType kind; // VAR_DECL, PRINT_STMT, INPUT_DECL or FN_DECL (no instructions)
+    std::string name;
+    int line;
+};
+
+struct IRProgram {
+    std::vector<Instruction> instructions;
+    std::vector<IRStatement> statements;
+    // Declared fns; backends emit one kernel per specialisation
+    std::vector<FnDecl*> functions;
+
+    // Number of operand slots reading each value
+    std::vector<int> use_counts() const;
+    // Drops removed instructions and renumbers the operands of the rest
+    void compact();
+};
+
+Effect effect_of(const Instruction& inst);
+const char* opcode_name(Opcode op);
+char binary_operator(Opcode op); // '+', '-', '*', '/' for ADD .. DIV
+
+// Lowers a type-checked program
+IRProgram lower_program(Program* program);
+
+// Checks the SSA and type invariants; on failure error names the first
+// broken instruction. Passes must keep these:
+//  - instructions of one statement are contiguous and in statement order
+//  - operands are defined before they are used, by value-producing instructions
+//  - each opcode has its operand count and operand types
+//  - element-wise operands have equal lengths when both are known
+//  - a value used by another statement is a LET, an INPUT or a scalar
+//    CONST, since backends may scope other values to their statement
+bool verify_ir(const IRProgram& program, std::string& error);
+
+void dump_ir(std::ostream& out, const IRProgram& program);
@@ -6,15 +6,20 @@ enum class TokenType {
     // Keywords
     LET,
     PRINT,
+    INPUT,
+    FN,
     
     // Types
     TYPE_INT,
     TYPE_FLOAT,
     TYPE_VEC,
+    TYPE_MAT,
+    TYPE_SVEC,
     
     // Literals
     INT_LITERAL,
     FLOAT_LITERAL,
+    VEC_LITERAL,    // body of a [ ... ] holding only numbers, parsed in bulk by the parser
     
     // Identifiers
     IDENTIFIER,
@@ -27,12 +32,15 @@ enum class TokenType {
     ASSIGN,
     COLON,
     COMMA,
+    PIPE,
     
     // Delimiters
     LPAREN,
     RPAREN,
     LBRACKET,
     RBRACKET,
+    LBRACE,
+    RBRACE,
     
     // Special
     END_OF_FILE,
@@ -68,6 +76,7 @@ private:
     
     Token read_number();
     Token read_identifier();
+    bool try_read_vec_literal(std::vector<Token>& tokens);
     
     bool is_digit(char c);
     bool is_alpha(char c);
@@ -0,0 +1,50 @@
+#pragma once
+#include "codegen.h"
+#include <string>
+#include <vector>
+#include <ostream>
+
+// Command line options for one mmlc invocation
+struct CompilerOptions {
+    std::string source_file;
+    std::string output_file = "output";
+
+    // -O0 .. -O3: selects both the MiniMathLang passes and the backend flags
+    int opt_level = 2;
+
+    // --target-cpu=<cpu>: forwarded to the backend as -march (e.g. native, skylake)
+    std::string target_cpu;
+
+    // --backend-cc=<compiler>: C++ compiler used to build the generated code
+    std::string backend_cc = "g++";
+
+    // --print-pipeline: show the passes and backend command before compiling
+    bool print_pipeline = false;
+
+    // --dump-ir: print the IR after lowering and after every pass that changes it;
+    // --verify-ir: check the IR invariants after lowering and after every pass
+    bool dump_ir = false;
+    bool verify_ir = false;
+
+    // --server[=<socket>]: run as a compile daemon instead of compiling;
+    // --connect[=<socket>]: hand this compile to a running daemon
+    bool server = false;
+    bool connect = false;
+    std::string socket_path;
+
+    CodeGenOptions codegen;
+};
+
+bool parse_options(int argc, char** argv, CompilerOptions& options, std::string& error);
+std::string usage(const std::string& program);
+
+// MiniMathLang-level passes enabled at the selected optimisation level, in run order
+std::vector<std::string> enabled_passes(const CompilerOptions& options);
+
+std::vector<std::string> backend_flags(const CompilerOptions& options);
+// The backend's argument vector, for run_command
+std::vector<std::string> backend_args(const CompilerOptions& options, const std::string& cpp_file);
+// backend_args as a shell-quoted command line, for display
+std::string backend_command(const CompilerOptions& options, const std::string& cpp_file);
+
+void print_pipeline(std::ostream& out, const CompilerOptions& options, const std::string& cpp_file);
@@ -5,7 +5,7 @@
 
 class Parser {
 public:
-    Parser(const std::vector<Token>& tokens, Arena& arena);
+    Parser(std::vector<Token> tokens, Arena& arena);
     Program* parse();
     
 private:
@@ -13,8 +13,8 @@ private:
     size_t pos;
     Arena& arena;
     
-    Token current();
-    Token peek();
+    const Token& current();
+    const Token& peek();
     void advance();
     bool match(TokenType type);
     Token expect(TokenType type);
@@ -22,16 +22,26 @@ private:
     ASTNode* parse_statement();
     ASTNode* parse_var_decl();
     ASTNode* parse_print_stmt();
+    ASTNode* parse_input_decl();
+    ASTNode* parse_fn_decl();
     ASTNode* parse_expression();
-    ASTNode* parse_term();
-    ASTNode* parse_factor();
     ASTNode* parse_primary();
+    ASTNode* parse_vec_literal(const Token& body);
+    ASTNode* parse_mat_literal();
+    ASTNode* parse_svec_literal();
+    ASTNode* parse_call(const Token& name);
+    ASTNode* parse_slice(ASTNode* vec);
     
     Type parse_type();
+    Shape parse_shape(Type type);
+    size_t parse_dimension();
     
     template<typename T, typename... Args>
     T* allocate(Args&&... args) {
-        void* mem = arena.allocate(sizeof(T));
-        return new (mem) T(std::forward<Args>(args)...);
+        return arena.create<T>(std::forward<Args>(args)...);
+    }
+    
+    float* allocate_floats(size_t count) {
+        return static_cast<float*>(arena.allocate(count * sizeof(float)));
     }
 };
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+#include "ir.h"
+#include <ostream>
+#include <string>
+#include <vector>
+
+// An IR pass rewrites the program in place and returns how many
+// instructions it changed. Folding passes allocate new literals in arena.
+typedef int (*IRPass)(IRProgram& program, Arena& arena);
+
+struct PassTiming {
+    std::string name;
+    int changes;
+    double milliseconds;
+};
+
+// Runs named passes in order over a lowered program, timing each one
+class PassManager {
+public:
+    // Throws std::runtime_error for an unknown pass name
+    PassManager(Arena& arena, const std::vector<std::string>& passes);
+
+    // --verify-ir: check the IR after lowering and after every pass
+    void set_verify(bool enabled) { verify = enabled; }
+    // --dump-ir: write the lowered IR and the IR after every pass that changed it
+    void set_dump(std::ostream* stream) { dump = stream; }
+
+    // Throws std::runtime_error naming the pass that broke an invariant
+    void run(IRProgram& program);
+
+    const std::vector<PassTiming>& timings() const { return results; }
+
+private:
+    Arena& arena;
+    std::vector<std::pair<std::string, IRPass>> pipeline;
+    bool verify;
+    std::ostream* dump;
+    std::vector<PassTiming> results;
+
+    void check(const IRProgram& program, const std::string& stage);
+};
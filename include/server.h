@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include <vector>
+
+// $MMLC_SOCKET, $XDG_RUNTIME_DIR/mmlc.sock, or mmlc.sock in a 0700
+// directory /tmp/mmlc-<uid>, which is created if needed. False with error
+// set when that directory exists but others could write to it.
+bool default_socket_path(std::string& path, std::string& error);
+
+// mmlc --server: compiles requests from mmlc --connect clients on a Unix
+// domain socket, one worker per hardware thread, until SIGINT or SIGTERM
+int run_server(const std::string& socket_path);
+
+// mmlc --connect: sends args (the command line without --connect) and the
+// working directory to the daemon, replays what the compile printed and
+// returns its exit status
+int run_client(const std::string& socket_path, const std::vector<std::string>& args);
@@ -1,20 +1,41 @@
 #pragma once
 #include "ast.h"
 #include <unordered_map>
+#include <ostream>
 #include <string>
 
 class TypeChecker {
 public:
-    TypeChecker();
+    // Errors are reported to diagnostics; typed copies of fn bodies are
+    // allocated in arena
+    TypeChecker(Arena& arena, std::ostream& diagnostics);
     bool check(Program* program);
 
 private:
-    std::unordered_map<std::string, Type> symbol_table;
+    struct Symbol {
+        Type type;
+        Shape shape;
+    };
+    
+    std::unordered_map<std::string, Symbol> symbol_table;
+    // fns declared so far; null for one whose declaration has errors
+    std::unordered_map<std::string, FnDecl*> functions;
+    Arena& arena;
+    std::ostream& diagnostics;
     bool has_errors;
+    bool declaring; // checking a fn declaration, whose typed bodies are not kept
 
     Type check_node(ASTNode* node);
+    Type check_expression(ASTNode*& expr);
     void error(const std::string& message);
 
     bool is_numeric(Type t);
-    Type infer_binary_op(char op, Type left, Type right);
+    Type infer_binary_op(BinaryOp* node);
+    Type infer_sparse_op(BinaryOp* node);
+    Type infer_call(Call* node);
+    Type infer_fn_call(Call* node, FnDecl* fn);
+    void check_fn_decl(FnDecl* fn);
+    ASTNode* specialise(FnDecl* fn, const std::vector<Type>& types, size_t& index);
+    ASTNode* copy_body(ASTNode* body);
+    Type infer_slice(Slice* node);
 };
\ No newline at end of file
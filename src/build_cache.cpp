@@ -0,0 +1,117 @@
+#include "build_cache.h"
+#include "driver.h"
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+BuildCache::BuildCache(size_t max_results) : max_results(max_results), next_file(0) {}
+
+BuildCache::~BuildCache() {
+    if (!dir.empty()) {
+        std::error_code ec;
+        fs::remove_all(dir, ec);
+    }
+}
+
+bool BuildCache::open(std::string& error) {
+    fs::path base = fs::temp_directory_path() / "mmlc-cache-XXXXXX";
+    std::string tmpl = base.string();
+    if (!mkdtemp(&tmpl[0])) {
+        error = "could not create a cache directory in " + fs::temp_directory_path().string();
+        return false;
+    }
+    dir = tmpl;
+    return true;
+}
+
+std::string BuildCache::new_file(const std::string& suffix) {
+    return dir + "/" + std::to_string(next_file++) + suffix;
+}
+
+// The first request for a runtime writes and precompiles it while later ones
+// wait; a failed precompile only costs speed, the header still works
+std::string BuildCache::runtime_header(const std::string& runtime, const CompilerOptions& options) {
+    std::vector<std::string> args = backend_flags(options);
+    args.insert(args.begin(), options.backend_cc);
+    std::string key;
+    for (const std::string& arg : args) {
+        key += arg + '\0';
+    }
+    key += runtime;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    auto it = headers.find(key);
+    if (it != headers.end()) {
+        header_ready.wait(lock, [&]() { return it->second.ready; });
+        return it->second.path;
+    }
+    std::string path = new_file("-runtime.h");
+    it = headers.emplace(key, Header{path, false}).first;
+    lock.unlock();
+
+    std::ofstream(path, std::ios::binary) << runtime;
+    args.insert(args.end(), {"-x", "c++-header", "-o", path + ".gch", path});
+    if (run_command(args, nullptr) != 0) {
+        std::error_code ec;
+        fs::remove(path + ".gch", ec);
+    }
+
+    lock.lock();
+    it->second.ready = true;
+    header_ready.notify_all();
+    return path;
+}
+
+std::string BuildCache::result_key(const CompilerOptions& options, const std::string& source) {
+    std::string key = options.backend_cc;
+    for (const std::string& flag : backend_flags(options)) {
+        key += " " + flag;
+    }
+    key += options.codegen.instrument ? " instrument" : "";
+    key += options.codegen.parallel ? " parallel" : "";
+    key += options.codegen.exact_math ? " exact-math" : "";
+    return key + '\0' + source;
+}
+
+bool BuildCache::restore(const std::string& key, const std::string& cpp_file, const std::string& binary) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = results.find(key);
+    if (it == results.end()) {
+        return false;
+    }
+    std::error_code ec;
+    fs::copy_file(it->second.cpp_file, cpp_file, fs::copy_options::overwrite_existing, ec);
+    if (!ec) {
+        fs::copy_file(it->second.binary, binary, fs::copy_options::overwrite_existing, ec);
+    }
+    return !ec;
+}
+
+void BuildCache::store(const std::string& key, const std::string& cpp_file, const std::string& binary) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (results.count(key)) {
+        return;
+    }
+    Result result{new_file(".cpp"), new_file(".bin")};
+    std::error_code ec;
+    fs::copy_file(cpp_file, result.cpp_file, ec);
+    if (!ec) {
+        fs::copy_file(binary, result.binary, ec);
+    }
+    if (ec) {
+        fs::remove(result.cpp_file, ec);
+        return;
+    }
+    results.emplace(key, result);
+    result_order.push_back(key);
+
+    if (result_order.size() > max_results) {
+        auto oldest = results.find(result_order.front());
+        fs::remove(oldest->second.cpp_file, ec);
+        fs::remove(oldest->second.binary, ec);
+        results.erase(oldest);
+        result_order.pop_front();
+    }
+}
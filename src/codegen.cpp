@@ -1,170 +1,1920 @@
 #include "codegen.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
 #include <iostream>
+#include <set>
 
-CodeGen::CodeGen() : temp_counter(0) {}
+// Exact C++ spelling of a float: hex-float literals round-trip bit for bit
+static std::string format_float(float value) {
+    if (std::isnan(value)) return "NAN";
+    if (std::isinf(value)) return value < 0 ? "(-INFINITY)" : "INFINITY";
 
-std::string CodeGen::generate(Program* program) {
-    output.str("");
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%a", static_cast<double>(value));
+    return std::string(buf) + "f";
+}
+
+// C++ name of a variable or fn parameter. User names get a prefix of
+// their own, so they can't collide with C++ keywords, the runtime, or
+// the locals of the generated main (arena, mml_out, graph, temporaries)
+static std::string variable_name(const std::string& name) {
+    return "mml_v_" + name;
+}
+
+// C++ name of a fn specialisation; its map loop adds _map
+static std::string kernel_name(const FnDecl* fn, size_t specialisation) {
+    return "mml_fn_" + fn->name + "_" + std::to_string(specialisation);
+}
+
+CodeGen::CodeGen(const CodeGenOptions& options)
+    : temp_counter(0), options(options), ir(nullptr), current_task(0) {}
+
+// Decides which runtime parts the program needs and resets the liveness state
+void CodeGen::analyse(const IRProgram& program) {
+    ir = &program;
+    prof_sites.clear();
+    input_slots.clear();
+    uses_matrices = false;
+    uses_sparse = false;
+    uses_math = false;
+    uses_kernels = false;
+    for (const Instruction& inst : program.instructions) {
+        uses_matrices = uses_matrices || inst.type == Type::MAT;
+        uses_sparse = uses_sparse || inst.type == Type::SVEC;
+        if (inst.op == Opcode::CALL && !static_cast<Call*>(inst.node)->fn) {
+            uses_math = uses_math || (inst.name != "dense" && inst.name != "sparse");
+        }
+        if (inst.op == Opcode::INPUT) {
+            size_t slots = inst.shape.known ? inst.shape.rows * inst.shape.cols : 1;
+            input_slots.insert(input_slots.end(), slots, inst.type == Type::INT ? 0 : 1);
+        }
+    }
+    for (FnDecl* fn : program.functions) {
+        for (FnDecl::Specialisation& spec : fn->specialisations) {
+            uses_kernels = uses_kernels || spec.elementwise;
+            visit_postorder(spec.body, [this](ASTNode*& n) {
+                uses_math = uses_math || (n->node_type == NodeType::CALL && !static_cast<Call*>(n)->fn);
+            });
+        }
+    }
+    batch_mode = !input_slots.empty();
+    task_graph = options.parallel && !batch_mode;
+    input_offset = 0;
+    reset_liveness();
+}
 
+bool CodeGen::generate_runtime(const IRProgram& program, std::string& runtime) {
+    output.open_string(runtime);
+    analyse(program);
     emit_runtime();
+    return output.close();
+}
 
-    output << "\nint main() {\n";
-    output << "    Arena arena(4096);\n\n";
+bool CodeGen::generate(const IRProgram& program, const std::string& filename) {
+    if (!output.open(filename)) {
+        return false;
+    }
+    analyse(program);
+
+    emit_runtime();
+    emit_kernels();
+
+    if (batch_mode) {
+        generate_batch_main();
+    } else if (task_graph) {
+        generate_task_graph_main();
+    } else {
+        output << "\nint main() {\n";
+        output << "    Arena arena(1 << 16);\n";
+        output << "    [[maybe_unused]] std::ostream& mml_out = std::cout;\n";
+        if (options.instrument) {
+            output << "    std::atexit(prof_dump);\n";
+        }
+        output << "\n";
+
+        size_t next = 0;
+        for (size_t s = 0; s < program.statements.size(); s++) {
+            generate_statement(s, next);
+        }
+
+        output << "\n    return 0;\n";
+        output << "}\n";
+    }
 
-    for (ASTNode* stmt : program->statements) {
-        generate_statement(stmt);
+    if (options.instrument) {
+        emit_profiler_sites();
     }
 
-    output << "\n    return 0;\n";
+    return output.close();
+}
+
+// Programs with input declarations run their body once per input record:
+// mml_run() holds the statements and main() hands it to the batch driver.
+void CodeGen::generate_batch_main() {
+    output << "\nstatic void mml_run([[maybe_unused]] Arena& arena, const float* mml_in,\n";
+    output << "                    [[maybe_unused]] std::ostream& mml_out) {\n";
+    size_t next = 0;
+    for (size_t s = 0; s < ir->statements.size(); s++) {
+        generate_statement(s, next);
+    }
+    output << "}\n\n";
+
+    output << "static const unsigned char mml_input_slots[" << input_slots.size() << "] = {";
+    for (size_t i = 0; i < input_slots.size(); i++) {
+        output << (i % 16 == 0 ? "\n    " : " ") << static_cast<int>(input_slots[i]) << ",";
+    }
+    output << "\n};\n\n";
+
+    output << "int main(int argc, char** argv) {\n";
+    if (options.instrument) {
+        output << "    std::atexit(prof_dump);\n";
+    }
+    output << "    return mml_batch_main(argc, argv, mml_input_slots, " << input_slots.size() << ", mml_run);\n";
     output << "}\n";
+}
+
+// --parallel: every statement becomes a task of a static graph. Edges are
+// the data dependencies between statements, the source order of prints, and
+// the reads that must finish before a later statement reuses their buffer.
+void CodeGen::generate_task_graph_main() {
+    const std::vector<Instruction>& insts = ir->instructions;
+    output << "\nint main() {\n";
+    output << "    [[maybe_unused]] std::ostream& mml_out = std::cout;\n";
+    if (options.instrument) {
+        output << "    std::atexit(prof_dump);\n";
+    }
+    for (size_t id = 0; id < insts.size(); id++) {
+        const Instruction& inst = insts[id];
+        if (inst.op == Opcode::LET) {
+            output << "    " << unused(id) << cpp_type(inst.type) << " " << variable_name(inst.name) << "{};\n";
+        }
+    }
+    output << "    TaskGraph graph(" << ir->statements.size() << ");\n\n";
+
+    bool printed = false;
+    size_t last_print = 0;
+    size_t next = 0;
+    task_edges.clear();
+    for (size_t i = 0; i < ir->statements.size(); i++) {
+        current_task = i;
+
+        // Values from other statements are lets (or inlined constants)
+        for (size_t k = next; k < insts.size() && insts[k].statement == i; k++) {
+            for (size_t value : insts[k].operands) {
+                const Instruction& def = insts[value];
+                if (def.op == Opcode::LET && def.statement != i) task_edges.push_back({def.statement, i});
+            }
+        }
+        if (ir->statements[i].kind == NodeType::PRINT_STMT) {
+            if (printed) task_edges.push_back({last_print, i});
+            printed = true;
+            last_print = i;
+        }
 
-    return output.str();
+        output << "    graph.add(" << i << ", [&]([[maybe_unused]] Arena& arena) {\n";
+        generate_statement(i, next);
+        output << "    });\n";
+    }
+
+    std::sort(task_edges.begin(), task_edges.end());
+    task_edges.erase(std::unique(task_edges.begin(), task_edges.end()), task_edges.end());
+    output << "\n";
+    for (const std::pair<size_t, size_t>& edge : task_edges) {
+        output << "    graph.edge(" << edge.first << ", " << edge.second << ");\n";
+    }
+    output << "    graph.run(mml_thread_count());\n";
+    output << "    return 0;\n";
+    output << "}\n";
 }
 
+// The runtime is guarded so the daemon can hand the backend a precompiled
+// copy with -include; the copy in the file is then skipped
 void CodeGen::emit_runtime() {
+    output << "#ifndef MML_RUNTIME\n";
+    output << "#define MML_RUNTIME\n";
     output << "#include <iostream>\n";
     output << "#include <vector>\n";
-    output << "#include <cstring>\n\n";
+    output << "#include <algorithm>\n";
+    output << "#include <cmath>\n";
+    output << "#include <cstdlib>\n";
+    output << "#include <cstring>\n";
+    if (uses_matrices || batch_mode || task_graph) {
+        output << "#include <thread>\n";
+    }
+    if (uses_sparse || uses_math) {
+        output << "#include <cstdint>\n";
+    }
+    if (task_graph) {
+        output << "#include <atomic>\n";
+        output << "#include <condition_variable>\n";
+        output << "#include <deque>\n";
+        output << "#include <functional>\n";
+        output << "#include <memory>\n";
+        output << "#include <mutex>\n";
+    }
+    if (batch_mode) {
+        output << "#include <condition_variable>\n";
+        output << "#include <cstdint>\n";
+        output << "#include <fstream>\n";
+        output << "#include <functional>\n";
+        output << "#include <memory>\n";
+        output << "#include <mutex>\n";
+        output << "#include <sstream>\n";
+        output << "#include <string>\n";
+    }
+    if (options.instrument) {
+        output << "#include <chrono>\n";
+        output << "#include <cstdint>\n";
+        output << "#include <cstdio>\n";
+        output << "#if defined(__x86_64__) || defined(__i386__)\n";
+        output << "#include <x86intrin.h>\n";
+        output << "#endif\n";
+    }
+    output << "\n";
 
-    output << "// Arena allocator\n";
+    output << "// Arena allocator: grows in blocks, every allocation 64-byte aligned.\n";
+    output << "// Released buffers go on a free list for reuse; reset() keeps the regular\n";
+    output << "// blocks for reuse and frees oversized ones.\n";
     output << "class Arena {\n";
     output << "public:\n";
-    output << "    Arena(size_t size) : size(size), offset(0) {\n";
-    output << "        buffer = new char[size];\n";
+    output << "    Arena(size_t block_size) : block_size(block_size), block_index(0), offset(0), total(0) {}\n";
+    output << "    Arena(const Arena&) = delete;\n";
+    output << "    Arena& operator=(const Arena&) = delete;\n";
+    output << "    ~Arena() {\n";
+    output << "        for (char* block : blocks) std::free(block);\n";
+    output << "        for (char* block : large_blocks) std::free(block);\n";
     output << "    }\n";
-    output << "    ~Arena() { delete[] buffer; }\n";
     output << "    void* allocate(size_t n) {\n";
-    output << "        if (offset + n > size) throw std::bad_alloc();\n";
-    output << "        void* ptr = buffer + offset;\n";
-    output << "        offset += n;\n";
-    output << "        return ptr;\n";
+    output << "        const size_t align = 64;\n";
+    output << "        size_t rounded = (n + align - 1) & ~(align - 1);\n";
+    output << "        for (size_t i = free_list.size(); i-- > 0;) {\n";
+    output << "            if (free_list[i].bytes == rounded) {\n";
+    output << "                char* data = free_list[i].data;\n";
+    output << "                free_list[i] = free_list.back();\n";
+    output << "                free_list.pop_back();\n";
+    output << "                return data;\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "        total += n;\n";
+    output << "        if (n > block_size / 2) {\n";
+    output << "            // Large buffers get their own block so the current one keeps filling\n";
+    output << "            char* block = new_block(rounded);\n";
+    output << "            large_blocks.push_back(block);\n";
+    output << "            return block;\n";
+    output << "        }\n";
+    output << "        size_t start = (offset + align - 1) & ~(align - 1);\n";
+    output << "        if (blocks.empty() || start + n > block_size) {\n";
+    output << "            if (!blocks.empty()) block_index++;\n";
+    output << "            if (block_index == blocks.size()) blocks.push_back(new_block(block_size));\n";
+    output << "            start = 0;\n";
+    output << "        }\n";
+    output << "        offset = start + n;\n";
+    output << "        return blocks[block_index] + start;\n";
     output << "    }\n";
+    output << "    // Hands a dead buffer back; the next allocation of the same rounded size reuses it\n";
+    output << "    void release(void* data, size_t n) {\n";
+    output << "        if (n == 0) return;\n";
+    output << "        free_list.push_back({(char*)data, (n + 63) & ~(size_t)63});\n";
+    output << "    }\n";
+    output << "    void reset() {\n";
+    output << "        for (char* block : large_blocks) std::free(block);\n";
+    output << "        large_blocks.clear();\n";
+    output << "        free_list.clear();\n";
+    output << "        block_index = 0;\n";
+    output << "        offset = 0;\n";
+    output << "    }\n";
+    output << "    // Bytes carved from blocks; reused buffers are not counted again\n";
+    output << "    size_t used() const { return total; }\n";
     output << "private:\n";
-    output << "    char* buffer;\n";
-    output << "    size_t size;\n";
+    output << "    struct FreeBuffer {\n";
+    output << "        char* data;\n";
+    output << "        size_t bytes;\n";
+    output << "    };\n\n";
+    output << "    static char* new_block(size_t bytes) {\n";
+    output << "        char* block = (char*)std::aligned_alloc(64, bytes);\n";
+    output << "        if (!block) throw std::bad_alloc();\n";
+    output << "        return block;\n";
+    output << "    }\n\n";
+    output << "    size_t block_size;\n";
+    output << "    std::vector<char*> blocks;\n";
+    output << "    std::vector<char*> large_blocks;\n";
+    output << "    std::vector<FreeBuffer> free_list;\n";
+    output << "    size_t block_index;\n";
     output << "    size_t offset;\n";
+    output << "    size_t total;\n";
     output << "};\n\n";
 
-    output << "// Vector type\n";
+    if (options.instrument) {
+        emit_profiler_runtime();
+    }
+
+    output << "// Vector type. Results own a unit-stride arena buffer; slices are views\n";
+    output << "// whose data points into another vector's storage, stride elements apart\n";
     output << "struct Vec {\n";
     output << "    float* data;\n";
     output << "    size_t size;\n";
-    output << "    Vec(Arena& arena, size_t s) : size(s) {\n";
+    output << "    size_t stride;\n";
+    output << "    Vec() : data(nullptr), size(0), stride(1) {}\n";
+    output << "    Vec(Arena& arena, size_t s) : size(s), stride(1) {\n";
     output << "        data = (float*)arena.allocate(s * sizeof(float));\n";
     output << "    }\n";
-    output << "    float& operator[](size_t i) { return data[i]; }\n";
+    output << "    // Borrows read-only static data (vector literals) or another vector's\n";
+    output << "    // storage (slices); never written to\n";
+    output << "    Vec(const float* d, size_t s, size_t st = 1) : data(const_cast<float*>(d)), size(s), stride(st) {}\n";
+    output << "    float& operator[](size_t i) const { return data[i * stride]; }\n";
     output << "};\n\n";
 
-    output << "Vec vec_add(Arena& arena, const Vec& a, const Vec& b) {\n";
-    output << "    Vec result(arena, a.size);\n";
-    output << "    for (size_t i = 0; i < a.size; i++)\n";
-    output << "        result[i] = a.data[i] + b.data[i];\n";
+    output << "// v[start:stop:step] for bounds the compiler has checked\n";
+    output << "inline Vec vec_view(const Vec& v, size_t start, size_t count, size_t step) {\n";
+    output << "    return Vec(v.data + start * v.stride, count, v.stride * step);\n";
+    output << "}\n\n";
+
+    output << "// Checked form for bounds only known at run time\n";
+    output << "Vec vec_slice(const Vec& v, long long start, long long stop, long long step, int line) {\n";
+    output << "    if (step < 1 || start < 0 || start > stop || (unsigned long long)stop > v.size) {\n";
+    output << "        std::cerr << \"error: line \" << line << \": slice [\" << start << \":\" << stop << \":\" << step\n";
+    output << "                  << \"] out of range for vec[\" << v.size << \"]\\n\";\n";
+    output << "        std::exit(1);\n";
+    output << "    }\n";
+    output << "    return vec_view(v, start, (stop - start + step - 1) / step, step);\n";
+    output << "}\n\n";
+
+    output << "// Operands whose lengths the compiler could not prove equal\n";
+    output << "inline void vec_check_length(size_t a, size_t b, char op) {\n";
+    output << "    if (a != b) {\n";
+    output << "        std::cerr << \"error: vector length mismatch for operator '\" << op << \"': \"\n";
+    output << "                  << a << \" and \" << b << \"\\n\";\n";
+    output << "        std::exit(1);\n";
+    output << "    }\n";
+    output << "}\n\n";
+
+    if (uses_kernels) {
+        output << "// Vec arguments of an element-wise fn call\n";
+        output << "inline void vec_check_arg_length(size_t a, size_t b, const char* fn) {\n";
+        output << "    if (a != b) {\n";
+        output << "        std::cerr << \"error: vector length mismatch in call to '\" << fn << \"': \"\n";
+        output << "                  << a << \" and \" << b << \"\\n\";\n";
+        output << "        std::exit(1);\n";
+        output << "    }\n";
+        output << "}\n\n";
+    }
+
+    output << "// Element-wise kernels write into result, which is either a fresh buffer or\n";
+    output << "// the buffer of an operand that dies here (same index only, so ivdep holds).\n";
+    output << "// Results are always unit stride; inputs take the contiguous loop unless\n";
+    output << "// one of them is a strided slice.\n";
+    output << "Vec vec_add(Vec result, const Vec& a, const Vec& b) {\n";
+    emit_elem_count("a.size");
+    output << "    if (a.stride == 1 && b.stride == 1) {\n";
+    output << "#pragma GCC ivdep\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a.data[i] + b.data[i];\n";
+    output << "    } else {\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a[i] + b[i];\n";
+    output << "    }\n";
     output << "    return result;\n";
     output << "}\n\n";
 
-    output << "Vec vec_sub(Arena& arena, const Vec& a, const Vec& b) {\n";
-    output << "    Vec result(arena, a.size);\n";
-    output << "    for (size_t i = 0; i < a.size; i++)\n";
-    output << "        result[i] = a.data[i] - b.data[i];\n";
+    output << "Vec vec_sub(Vec result, const Vec& a, const Vec& b) {\n";
+    emit_elem_count("a.size");
+    output << "    if (a.stride == 1 && b.stride == 1) {\n";
+    output << "#pragma GCC ivdep\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a.data[i] - b.data[i];\n";
+    output << "    } else {\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a[i] - b[i];\n";
+    output << "    }\n";
     output << "    return result;\n";
     output << "}\n\n";
 
-    output << "Vec vec_mul(Arena& arena, const Vec& a, const Vec& b) {\n";
-    output << "    Vec result(arena, a.size);\n";
-    output << "    for (size_t i = 0; i < a.size; i++)\n";
-    output << "        result[i] = a.data[i] * b.data[i];\n";
+    output << "Vec vec_mul(Vec result, const Vec& a, const Vec& b) {\n";
+    emit_elem_count("a.size");
+    output << "    if (a.stride == 1 && b.stride == 1) {\n";
+    output << "#pragma GCC ivdep\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a.data[i] * b.data[i];\n";
+    output << "    } else {\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a[i] * b[i];\n";
+    output << "    }\n";
     output << "    return result;\n";
     output << "}\n\n";
 
-    output << "Vec vec_div(Arena& arena, const Vec& a, const Vec& b) {\n";
-    output << "    Vec result(arena, a.size);\n";
-    output << "    for (size_t i = 0; i < a.size; i++)\n";
-    output << "        result[i] = a.data[i] / b.data[i];\n";
+    output << "Vec vec_div(Vec result, const Vec& a, const Vec& b) {\n";
+    emit_elem_count("a.size");
+    output << "    if (a.stride == 1 && b.stride == 1) {\n";
+    output << "#pragma GCC ivdep\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a.data[i] / b.data[i];\n";
+    output << "    } else {\n";
+    output << "        for (size_t i = 0; i < a.size; i++)\n";
+    output << "            result.data[i] = a[i] / b[i];\n";
+    output << "    }\n";
     output << "    return result;\n";
     output << "}\n\n";
 
-    output << "Vec vec_scalar_add(Arena& arena, const Vec& v, float s) {\n";
-    output << "    Vec result(arena, v.size);\n";
-    output << "    for (size_t i = 0; i < v.size; i++)\n";
-    output << "        result[i] = v.data[i] + s;\n";
+    output << "Vec vec_scalar_add(Vec result, const Vec& v, float s) {\n";
+    emit_elem_count("v.size");
+    output << "    if (v.stride == 1) {\n";
+    output << "#pragma GCC ivdep\n";
+    output << "        for (size_t i = 0; i < v.size; i++)\n";
+    output << "            result.data[i] = v.data[i] + s;\n";
+    output << "    } else {\n";
+    output << "        for (size_t i = 0; i < v.size; i++)\n";
+    output << "            result.data[i] = v[i] + s;\n";
+    output << "    }\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+
+    output << "Vec vec_scalar_mul(Vec result, const Vec& v, float s) {\n";
+    emit_elem_count("v.size");
+    output << "    if (v.stride == 1) {\n";
+    output << "#pragma GCC ivdep\n";
+    output << "        for (size_t i = 0; i < v.size; i++)\n";
+    output << "            result.data[i] = v.data[i] * s;\n";
+    output << "    } else {\n";
+    output << "        for (size_t i = 0; i < v.size; i++)\n";
+    output << "            result.data[i] = v[i] * s;\n";
+    output << "    }\n";
     output << "    return result;\n";
     output << "}\n\n";
 
-    output << "Vec vec_scalar_mul(Arena& arena, const Vec& v, float s) {\n";
+    output << "// Only called on the value that spans a whole buffer, never on a slice\n";
+    output << "inline void vec_release(Arena& arena, const Vec& v) {\n";
+    output << "    arena.release(v.data, v.size * sizeof(float));\n";
+    output << "}\n\n";
+
+    output << "void print_vec(std::ostream& out, const Vec& v) {\n";
+    output << "    out << \"[\";\n";
+    output << "    for (size_t i = 0; i < v.size; i++) {\n";
+    output << "        out << v[i];\n";
+    output << "        if (i < v.size - 1) out << \", \";\n";
+    output << "    }\n";
+    output << "    out << \"]\\n\";\n";
+    output << "}\n";
+
+    if (uses_matrices || batch_mode || task_graph) {
+        emit_thread_runtime();
+    }
+    if (uses_matrices || uses_math || uses_kernels) {
+        output << "\n";
+        emit_simd_runtime();
+    }
+    if (uses_math) {
+        emit_math_runtime();
+    }
+    if (uses_matrices) {
+        emit_matrix_runtime();
+    }
+    if (uses_sparse) {
+        emit_sparse_runtime();
+    }
+    if (batch_mode) {
+        emit_batch_runtime();
+    }
+    if (task_graph) {
+        emit_task_graph_runtime();
+    }
+    output << "#endif // MML_RUNTIME\n";
+}
+
+void CodeGen::emit_task_graph_runtime() {
+    output << "\n";
+    output << "// Static task graph (--parallel): one task per statement, run on a\n";
+    output << "// work-stealing pool. Each worker owns a deque and an arena; it runs its\n";
+    output << "// newest ready task and steals the oldest one from another worker when its\n";
+    output << "// own deque is empty. A task becomes ready once all its predecessors finish.\n";
+    output << "// A worker that finds nothing to run spins briefly, then sleeps until a task\n";
+    output << "// is queued or the graph is done, leaving its core to the running tasks.\n";
+    output << "class TaskGraph {\n";
+    output << "public:\n";
+    output << "    explicit TaskGraph(size_t n) : tasks(n), remaining(0), queued(0) {}\n";
+    output << "    void add(size_t id, std::function<void(Arena&)> fn) { tasks[id].fn = std::move(fn); }\n";
+    output << "    void edge(size_t from, size_t to) {\n";
+    output << "        tasks[from].successors.push_back(to);\n";
+    output << "        tasks[to].preds++;\n";
+    output << "    }\n";
+    output << "    void run(size_t threads) {\n";
+    output << "        threads = std::max<size_t>(1, std::min(threads, tasks.size()));\n";
+    output << "        for (size_t w = 0; w < threads; w++) workers.emplace_back(new Worker());\n";
+    output << "        remaining.store(tasks.size());\n";
+    output << "        size_t next = 0;\n";
+    output << "        for (size_t i = 0; i < tasks.size(); i++) {\n";
+    output << "            tasks[i].pending.store(tasks[i].preds);\n";
+    output << "            if (tasks[i].preds == 0) workers[next++ % threads]->ready.push_back(i);\n";
+    output << "        }\n";
+    output << "        queued.store(next);\n";
+    output << "        std::vector<std::thread> pool;\n";
+    output << "        for (size_t w = 1; w < threads; w++) pool.emplace_back([this, w] { work(w); });\n";
+    output << "        work(0);\n";
+    output << "        for (std::thread& t : pool) t.join();\n";
+    output << "    }\n";
+    output << "private:\n";
+    output << "    struct Task {\n";
+    output << "        std::function<void(Arena&)> fn;\n";
+    output << "        std::vector<size_t> successors;\n";
+    output << "        size_t preds = 0;\n";
+    output << "        std::atomic<size_t> pending{0};\n";
+    output << "    };\n";
+    output << "    struct Worker {\n";
+    output << "        std::mutex lock;\n";
+    output << "        std::deque<size_t> ready;\n";
+    output << "        Arena arena{1 << 16};\n";
+    output << "    };\n\n";
+    output << "    void work(size_t self) {\n";
+    output << "        // Kernels only split across threads when the graph runs on one worker\n";
+    output << "        bool was_in_worker = mml_in_worker;\n";
+    output << "        mml_in_worker = workers.size() > 1;\n";
+    output << "        Worker& me = *workers[self];\n";
+    output << "        int idle_rounds = 0;\n";
+    output << "        while (remaining.load(std::memory_order_acquire) > 0) {\n";
+    output << "            size_t id;\n";
+    output << "            if (!take(self, id)) {\n";
+    output << "                if (++idle_rounds < 64) {\n";
+    output << "                    std::this_thread::yield();\n";
+    output << "                    continue;\n";
+    output << "                }\n";
+    output << "                std::unique_lock<std::mutex> lock(idle_lock);\n";
+    output << "                idle.wait(lock, [this] { return queued.load() > 0 || remaining.load() == 0; });\n";
+    output << "                idle_rounds = 0;\n";
+    output << "                continue;\n";
+    output << "            }\n";
+    output << "            idle_rounds = 0;\n";
+    output << "            tasks[id].fn(me.arena);\n";
+    output << "            for (size_t s : tasks[id].successors) {\n";
+    output << "                if (tasks[s].pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {\n";
+    output << "                    {\n";
+    output << "                        std::lock_guard<std::mutex> lock(me.lock);\n";
+    output << "                        me.ready.push_back(s);\n";
+    output << "                    }\n";
+    output << "                    queued.fetch_add(1);\n";
+    output << "                    wake(false);\n";
+    output << "                }\n";
+    output << "            }\n";
+    output << "            if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) wake(true);\n";
+    output << "        }\n";
+    output << "        mml_in_worker = was_in_worker;\n";
+    output << "    }\n";
+    output << "    bool take(size_t self, size_t& id) {\n";
+    output << "        {\n";
+    output << "            Worker& me = *workers[self];\n";
+    output << "            std::lock_guard<std::mutex> lock(me.lock);\n";
+    output << "            if (!me.ready.empty()) {\n";
+    output << "                id = me.ready.back();\n";
+    output << "                me.ready.pop_back();\n";
+    output << "                queued.fetch_sub(1);\n";
+    output << "                return true;\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "        for (size_t k = 1; k < workers.size(); k++) {\n";
+    output << "            Worker& victim = *workers[(self + k) % workers.size()];\n";
+    output << "            std::lock_guard<std::mutex> lock(victim.lock);\n";
+    output << "            if (!victim.ready.empty()) {\n";
+    output << "                id = victim.ready.front();\n";
+    output << "                victim.ready.pop_front();\n";
+    output << "                queued.fetch_sub(1);\n";
+    output << "                return true;\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "        return false;\n";
+    output << "    }\n";
+    output << "    // Taking idle_lock orders this with a sleeper's check of queued and\n";
+    output << "    // remaining, so the notification cannot fall between check and wait\n";
+    output << "    void wake(bool all) {\n";
+    output << "        { std::lock_guard<std::mutex> lock(idle_lock); }\n";
+    output << "        if (all) idle.notify_all();\n";
+    output << "        else idle.notify_one();\n";
+    output << "    }\n\n";
+    output << "    std::vector<Task> tasks;\n";
+    output << "    std::vector<std::unique_ptr<Worker>> workers;\n";
+    output << "    std::atomic<size_t> remaining;\n";
+    output << "    std::atomic<size_t> queued; // tasks sitting in ready deques\n";
+    output << "    std::mutex idle_lock;\n";
+    output << "    std::condition_variable idle;\n";
+    output << "};\n";
+
+}
+
+void CodeGen::emit_thread_runtime() {
+    output << "\n";
+    output << "// Worker threads. MML_THREADS overrides the thread count; code already\n";
+    output << "// running on a worker (mml_in_worker) never spawns nested threads.\n";
+    output << "static thread_local bool mml_in_worker = false;\n\n";
+    output << "static size_t mml_thread_count() {\n";
+    output << "    static size_t count = [] {\n";
+    output << "        const char* env = std::getenv(\"MML_THREADS\");\n";
+    output << "        long n = env ? std::atol(env) : (long)std::thread::hardware_concurrency();\n";
+    output << "        return n > 0 ? (size_t)n : (size_t)1;\n";
+    output << "    }();\n";
+    output << "    return count;\n";
+    output << "}\n\n";
+    output << "// Splits [0, n) into contiguous chunks over threads when the work is large\n";
+    output << "// enough to pay for them\n";
+    output << "template <typename F>\n";
+    output << "void mml_parallel_for(size_t n, size_t work, F fn) {\n";
+    output << "    const size_t min_work_per_thread = 1 << 18;\n";
+    output << "    size_t threads = std::min(mml_thread_count(), std::max<size_t>(1, work / min_work_per_thread));\n";
+    output << "    threads = std::min(threads, n);\n";
+    output << "    if (threads <= 1 || mml_in_worker) {\n";
+    output << "        fn(0, n);\n";
+    output << "        return;\n";
+    output << "    }\n";
+    output << "    std::vector<std::thread> pool;\n";
+    output << "    size_t chunk = (n + threads - 1) / threads;\n";
+    output << "    for (size_t t = 1; t < threads; t++) {\n";
+    output << "        size_t begin = t * chunk;\n";
+    output << "        size_t end = std::min(n, begin + chunk);\n";
+    output << "        if (begin < end) {\n";
+    output << "            pool.emplace_back([&fn, begin, end] {\n";
+    output << "                mml_in_worker = true;\n";
+    output << "                fn(begin, end);\n";
+    output << "            });\n";
+    output << "        }\n";
+    output << "    }\n";
+    output << "    fn(0, std::min(n, chunk));\n";
+    output << "    for (std::thread& th : pool) th.join();\n";
+    output << "}\n";
+}
+
+void CodeGen::emit_batch_runtime() {
+    output << "\n";
+    output << "// Persistent worker pool: run(fn) calls fn(w) once on every worker\n";
+    output << "// (worker 0 is the calling thread) and returns when all have finished\n";
+    output << "class WorkerPool {\n";
+    output << "public:\n";
+    output << "    explicit WorkerPool(size_t n) : job(nullptr), generation(0), pending(0), stop(false) {\n";
+    output << "        for (size_t w = 1; w < n; w++) {\n";
+    output << "            threads.emplace_back([this, w] { worker(w); });\n";
+    output << "        }\n";
+    output << "    }\n";
+    output << "    ~WorkerPool() {\n";
+    output << "        {\n";
+    output << "            std::lock_guard<std::mutex> lock(mutex);\n";
+    output << "            stop = true;\n";
+    output << "        }\n";
+    output << "        start.notify_all();\n";
+    output << "        for (std::thread& t : threads) t.join();\n";
+    output << "    }\n";
+    output << "    size_t size() const { return threads.size() + 1; }\n";
+    output << "    void run(const std::function<void(size_t)>& fn) {\n";
+    output << "        {\n";
+    output << "            std::lock_guard<std::mutex> lock(mutex);\n";
+    output << "            job = &fn;\n";
+    output << "            pending = threads.size();\n";
+    output << "            generation++;\n";
+    output << "        }\n";
+    output << "        start.notify_all();\n";
+    output << "        mml_in_worker = true;\n";
+    output << "        fn(0);\n";
+    output << "        mml_in_worker = false;\n";
+    output << "        std::unique_lock<std::mutex> lock(mutex);\n";
+    output << "        done.wait(lock, [this] { return pending == 0; });\n";
+    output << "    }\n";
+    output << "private:\n";
+    output << "    void worker(size_t w) {\n";
+    output << "        mml_in_worker = true;\n";
+    output << "        size_t seen = 0;\n";
+    output << "        while (true) {\n";
+    output << "            const std::function<void(size_t)>* fn;\n";
+    output << "            {\n";
+    output << "                std::unique_lock<std::mutex> lock(mutex);\n";
+    output << "                start.wait(lock, [&] { return stop || generation != seen; });\n";
+    output << "                if (stop) return;\n";
+    output << "                seen = generation;\n";
+    output << "                fn = job;\n";
+    output << "            }\n";
+    output << "            (*fn)(w);\n";
+    output << "            {\n";
+    output << "                std::lock_guard<std::mutex> lock(mutex);\n";
+    output << "                pending--;\n";
+    output << "            }\n";
+    output << "            done.notify_one();\n";
+    output << "        }\n";
+    output << "    }\n\n";
+    output << "    std::vector<std::thread> threads;\n";
+    output << "    std::mutex mutex;\n";
+    output << "    std::condition_variable start;\n";
+    output << "    std::condition_variable done;\n";
+    output << "    const std::function<void(size_t)>* job;\n";
+    output << "    size_t generation;\n";
+    output << "    size_t pending;\n";
+    output << "    bool stop;\n";
+    output << "};\n\n";
+    output << "// Batch mode: the program body runs once per input record. A record is the\n";
+    output << "// program's input declarations in order, one 4-byte slot per scalar and one\n";
+    output << "// per vec/mat element (int slots hold the bits of an int32).\n";
+    output << "enum { MML_SLOT_INT = 0, MML_SLOT_FLOAT = 1 };\n\n";
+    output << "typedef void (*MmlRunFn)(Arena& arena, const float* mml_in, std::ostream& mml_out);\n\n";
+    output << "// Reads one CSV record; blank lines and lines starting with '#' are skipped\n";
+    output << "static bool mml_read_csv_record(std::istream& in, float* record, const unsigned char* slots,\n";
+    output << "                                size_t width, size_t& line_no) {\n";
+    output << "    std::string line;\n";
+    output << "    while (std::getline(in, line)) {\n";
+    output << "        line_no++;\n";
+    output << "        size_t first = line.find_first_not_of(\" \\t\\r\");\n";
+    output << "        if (first == std::string::npos || line[first] == '#') continue;\n\n";
+    output << "        const char* p = line.c_str();\n";
+    output << "        for (size_t i = 0; i < width; i++) {\n";
+    output << "            char* end;\n";
+    output << "            if (slots[i] == MML_SLOT_INT) {\n";
+    output << "                long v = std::strtol(p, &end, 10);\n";
+    output << "                int32_t iv = (int32_t)v;\n";
+    output << "                std::memcpy(&record[i], &iv, sizeof(iv));\n";
+    output << "            } else {\n";
+    output << "                record[i] = std::strtof(p, &end);\n";
+    output << "            }\n";
+    output << "            if (end == p) {\n";
+    output << "                std::cerr << \"error: input line \" << line_no << \": expected \" << width\n";
+    output << "                          << \" comma-separated values\" << std::endl;\n";
+    output << "                std::exit(1);\n";
+    output << "            }\n";
+    output << "            p = end;\n";
+    output << "            while (*p == ' ' || *p == '\\t' || *p == '\\r') p++;\n";
+    output << "            if (i + 1 < width) {\n";
+    output << "                if (*p != ',') {\n";
+    output << "                    std::cerr << \"error: input line \" << line_no << \": expected \" << width\n";
+    output << "                              << \" comma-separated values\" << std::endl;\n";
+    output << "                    std::exit(1);\n";
+    output << "                }\n";
+    output << "                p++;\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "        if (*p != '\\0') {\n";
+    output << "            std::cerr << \"error: input line \" << line_no << \": more than \" << width\n";
+    output << "                      << \" values\" << std::endl;\n";
+    output << "            std::exit(1);\n";
+    output << "        }\n";
+    output << "        return true;\n";
+    output << "    }\n";
+    output << "    return false;\n";
+    output << "}\n\n";
+    output << "static void mml_batch_usage(const char* program) {\n";
+    output << "    std::cerr << \"Usage: \" << program << \" [--csv | --binary] [--batch-size N] [--threads N] [input-file]\\n\"\n";
+    output << "              << \"Reads records from input-file (default stdin) and runs the program once per record.\\n\"\n";
+    output << "              << \"--binary records are packed native-endian int32/float32 slots.\" << std::endl;\n";
+    output << "}\n\n";
+    output << "int mml_batch_main(int argc, char** argv, const unsigned char* slots, size_t width, MmlRunFn run) {\n";
+    output << "    bool binary = false;\n";
+    output << "    size_t batch_size = 4096;\n";
+    output << "    size_t thread_count = mml_thread_count();\n";
+    output << "    const char* path = nullptr;\n";
+    output << "    for (int i = 1; i < argc; i++) {\n";
+    output << "        std::string arg = argv[i];\n";
+    output << "        if (arg == \"--binary\") binary = true;\n";
+    output << "        else if (arg == \"--csv\") binary = false;\n";
+    output << "        else if (arg == \"--batch-size\" && i + 1 < argc) batch_size = std::max(1L, std::atol(argv[++i]));\n";
+    output << "        else if (arg == \"--threads\" && i + 1 < argc) thread_count = std::max(1L, std::atol(argv[++i]));\n";
+    output << "        else if (arg[0] != '-' && !path) path = argv[i];\n";
+    output << "        else {\n";
+    output << "            mml_batch_usage(argv[0]);\n";
+    output << "            return 1;\n";
+    output << "        }\n";
+    output << "    }\n\n";
+    output << "    std::ifstream file;\n";
+    output << "    if (path) {\n";
+    output << "        file.open(path, binary ? std::ios::binary : std::ios::in);\n";
+    output << "        if (!file) {\n";
+    output << "            std::cerr << \"error: cannot open \" << path << std::endl;\n";
+    output << "            return 1;\n";
+    output << "        }\n";
+    output << "    }\n";
+    output << "    std::istream& in = path ? file : std::cin;\n";
+    output << "    std::ios::sync_with_stdio(false);\n\n";
+    output << "    WorkerPool pool(thread_count);\n";
+    output << "    std::vector<std::unique_ptr<Arena>> arenas;\n";
+    output << "    std::vector<std::ostringstream> outputs(pool.size());\n";
+    output << "    for (size_t w = 0; w < pool.size(); w++) {\n";
+    output << "        arenas.emplace_back(new Arena(1 << 16));\n";
+    output << "    }\n\n";
+    output << "    std::vector<float> records(batch_size * width);\n";
+    output << "    size_t line_no = 0;\n";
+    output << "    while (true) {\n";
+    output << "        size_t count = 0;\n";
+    output << "        if (binary) {\n";
+    output << "            in.read((char*)records.data(), (std::streamsize)(records.size() * sizeof(float)));\n";
+    output << "            size_t bytes = (size_t)in.gcount();\n";
+    output << "            if (bytes % (width * sizeof(float)) != 0) {\n";
+    output << "                std::cerr << \"error: truncated binary record at end of input\" << std::endl;\n";
+    output << "                return 1;\n";
+    output << "            }\n";
+    output << "            count = bytes / (width * sizeof(float));\n";
+    output << "        } else {\n";
+    output << "            while (count < batch_size &&\n";
+    output << "                   mml_read_csv_record(in, &records[count * width], slots, width, line_no)) {\n";
+    output << "                count++;\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "        if (count == 0) break;\n\n";
+    output << "        // Contiguous chunks per worker keep the output in record order\n";
+    output << "        pool.run([&](size_t w) {\n";
+    output << "            size_t chunk = (count + pool.size() - 1) / pool.size();\n";
+    output << "            size_t begin = std::min(count, w * chunk);\n";
+    output << "            size_t end = std::min(count, begin + chunk);\n";
+    output << "            for (size_t r = begin; r < end; r++) {\n";
+    output << "                run(*arenas[w], &records[r * width], outputs[w]);\n";
+    output << "            }\n";
+    output << "            arenas[w]->reset();\n";
+    output << "        });\n";
+    output << "        for (std::ostringstream& out : outputs) {\n";
+    output << "            std::cout << out.str();\n";
+    output << "            out.str(\"\");\n";
+    output << "        }\n";
+    output << "        if (count < batch_size) break;\n";
+    output << "    }\n";
+    output << "    std::cout.flush();\n";
+    output << "    return 0;\n";
+    output << "}\n";
+}
+
+// Native-width SIMD vector type shared by the hand-vectorised kernels
+void CodeGen::emit_simd_runtime() {
+    output << "// Native-width float vector (GCC/Clang vector extension), sized from the\n";
+    output << "// target the backend compiles for (see --target-cpu)\n";
+    output << "#if defined(__AVX512F__)\n";
+    output << "#define MML_LANES 16\n";
+    output << "#elif defined(__AVX__)\n";
+    output << "#define MML_LANES 8\n";
+    output << "#else\n";
+    output << "#define MML_LANES 4\n";
+    output << "#endif\n";
+    output << "typedef float mml_vf __attribute__((vector_size(MML_LANES * sizeof(float))));\n\n";
+    output << "static inline mml_vf mml_load(const float* p) {\n";
+    output << "    mml_vf v;\n";
+    output << "    std::memcpy(&v, p, sizeof(v));\n";
+    output << "    return v;\n";
+    output << "}\n\n";
+    output << "static inline void mml_store(float* p, mml_vf v) {\n";
+    output << "    std::memcpy(p, &v, sizeof(v));\n";
+    output << "}\n";
+}
+
+void CodeGen::emit_matrix_runtime() {
+    output << "\n";
+    output << "// Matrix type: row-major, 64-byte aligned storage in the arena\n";
+    output << "struct Mat {\n";
+    output << "    float* data;\n";
+    output << "    size_t rows;\n";
+    output << "    size_t cols;\n";
+    output << "    Mat() : data(nullptr), rows(0), cols(0) {}\n";
+    output << "    Mat(Arena& arena, size_t r, size_t c) : rows(r), cols(c) {\n";
+    output << "        data = (float*)arena.allocate(r * c * sizeof(float));\n";
+    output << "    }\n";
+    output << "    // Borrows read-only static data (matrix literals); never written to\n";
+    output << "    Mat(const float* d, size_t r, size_t c) : data(const_cast<float*>(d)), rows(r), cols(c) {}\n";
+    output << "    float* row(size_t i) const { return data + i * cols; }\n";
+    output << "};\n\n";
+    output << "Mat mat_add(Arena& arena, const Mat& a, const Mat& b) {\n";
+    output << "    Mat result(arena, a.rows, a.cols);\n";
+    output << "    size_t n = a.rows * a.cols;\n";
+    emit_elem_count("n");
+    output << "    for (size_t i = 0; i < n; i++)\n";
+    output << "        result.data[i] = a.data[i] + b.data[i];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "Mat mat_sub(Arena& arena, const Mat& a, const Mat& b) {\n";
+    output << "    Mat result(arena, a.rows, a.cols);\n";
+    output << "    size_t n = a.rows * a.cols;\n";
+    emit_elem_count("n");
+    output << "    for (size_t i = 0; i < n; i++)\n";
+    output << "        result.data[i] = a.data[i] - b.data[i];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "Mat mat_scalar_mul(Arena& arena, const Mat& m, float s) {\n";
+    output << "    Mat result(arena, m.rows, m.cols);\n";
+    output << "    size_t n = m.rows * m.cols;\n";
+    emit_elem_count("n");
+    output << "    for (size_t i = 0; i < n; i++)\n";
+    output << "        result.data[i] = m.data[i] * s;\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "// Contiguous copy of a strided slice\n";
+    output << "Vec vec_pack(Arena& arena, const Vec& v) {\n";
     output << "    Vec result(arena, v.size);\n";
     output << "    for (size_t i = 0; i < v.size; i++)\n";
-    output << "        result[i] = v.data[i] * s;\n";
+    output << "        result.data[i] = v[i];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "// y = A x. Four rows at a time share each load of x; the 8 partial sums per\n";
+    output << "// row are independent lanes so the inner loop vectorises without -ffast-math.\n";
+    output << "// A strided x is packed first: O(cols) next to the O(rows * cols) product.\n";
+    output << "Vec mat_vec_mul(Arena& arena, const Mat& a, const Vec& x_in) {\n";
+    output << "    Vec x = x_in.stride == 1 ? x_in : vec_pack(arena, x_in);\n";
+    output << "    Vec result(arena, a.rows);\n";
+    output << "    const size_t K = a.cols;\n";
+    emit_elem_count("a.rows * K");
+    output << "    const size_t K8 = K & ~(size_t)7;\n";
+    output << "    mml_parallel_for(a.rows, a.rows * K, [&](size_t begin, size_t end) {\n";
+    output << "        size_t i = begin;\n";
+    output << "        for (; i + 4 <= end; i += 4) {\n";
+    output << "            const float* r0 = a.row(i);\n";
+    output << "            const float* r1 = a.row(i + 1);\n";
+    output << "            const float* r2 = a.row(i + 2);\n";
+    output << "            const float* r3 = a.row(i + 3);\n";
+    output << "            float acc[4][8] = {};\n";
+    output << "            for (size_t k = 0; k < K8; k += 8) {\n";
+    output << "                for (size_t l = 0; l < 8; l++) {\n";
+    output << "                    float xv = x.data[k + l];\n";
+    output << "                    acc[0][l] += r0[k + l] * xv;\n";
+    output << "                    acc[1][l] += r1[k + l] * xv;\n";
+    output << "                    acc[2][l] += r2[k + l] * xv;\n";
+    output << "                    acc[3][l] += r3[k + l] * xv;\n";
+    output << "                }\n";
+    output << "            }\n";
+    output << "            for (size_t r = 0; r < 4; r++) {\n";
+    output << "                const float* row = a.row(i + r);\n";
+    output << "                float sum = 0.0f;\n";
+    output << "                for (size_t l = 0; l < 8; l++) sum += acc[r][l];\n";
+    output << "                for (size_t k = K8; k < K; k++) sum += row[k] * x.data[k];\n";
+    output << "                result.data[i + r] = sum;\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "        for (; i < end; i++) {\n";
+    output << "            const float* row = a.row(i);\n";
+    output << "            float sum = 0.0f;\n";
+    output << "            for (size_t k = 0; k < K; k++) sum += row[k] * x.data[k];\n";
+    output << "            result.data[i] = sum;\n";
+    output << "        }\n";
+    output << "    });\n";
+    output << "    if (x.data != x_in.data) vec_release(arena, x);\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "// C = A B, cache-blocked over (rows, depth, cols) with a 4 x (2 lanes)\n";
+    output << "// register tile: each tile keeps its accumulators in eight vector registers and streams\n";
+    output << "// one row of B per step of k as broadcast-multiply-adds.\n";
+    output << "const size_t MAT_MC = 64;   // rows of A per block\n";
+    output << "const size_t MAT_KC = 256;  // depth per block (A block + B panel stay in L2)\n";
+    output << "const size_t MAT_NC = 512;  // cols of B per block\n";
+    output << "const size_t MAT_MR = 4;\n";
+    output << "const size_t MAT_NR = 2 * MML_LANES;\n\n";
+    output << "static void mat_mul_tile(const Mat& a, const Mat& b, Mat& c,\n";
+    output << "                         size_t i, size_t j, size_t k0, size_t k1) {\n";
+    output << "    const float* a0 = a.row(i);\n";
+    output << "    const float* a1 = a.row(i + 1);\n";
+    output << "    const float* a2 = a.row(i + 2);\n";
+    output << "    const float* a3 = a.row(i + 3);\n";
+    output << "    mml_vf c00 = mml_load(c.row(i) + j),     c01 = mml_load(c.row(i) + j + MML_LANES);\n";
+    output << "    mml_vf c10 = mml_load(c.row(i + 1) + j), c11 = mml_load(c.row(i + 1) + j + MML_LANES);\n";
+    output << "    mml_vf c20 = mml_load(c.row(i + 2) + j), c21 = mml_load(c.row(i + 2) + j + MML_LANES);\n";
+    output << "    mml_vf c30 = mml_load(c.row(i + 3) + j), c31 = mml_load(c.row(i + 3) + j + MML_LANES);\n";
+    output << "    for (size_t k = k0; k < k1; k++) {\n";
+    output << "        const float* brow = b.row(k) + j;\n";
+    output << "        mml_vf b0 = mml_load(brow);\n";
+    output << "        mml_vf b1 = mml_load(brow + MML_LANES);\n";
+    output << "        c00 += a0[k] * b0; c01 += a0[k] * b1;\n";
+    output << "        c10 += a1[k] * b0; c11 += a1[k] * b1;\n";
+    output << "        c20 += a2[k] * b0; c21 += a2[k] * b1;\n";
+    output << "        c30 += a3[k] * b0; c31 += a3[k] * b1;\n";
+    output << "    }\n";
+    output << "    mml_store(c.row(i) + j, c00);     mml_store(c.row(i) + j + MML_LANES, c01);\n";
+    output << "    mml_store(c.row(i + 1) + j, c10); mml_store(c.row(i + 1) + j + MML_LANES, c11);\n";
+    output << "    mml_store(c.row(i + 2) + j, c20); mml_store(c.row(i + 2) + j + MML_LANES, c21);\n";
+    output << "    mml_store(c.row(i + 3) + j, c30); mml_store(c.row(i + 3) + j + MML_LANES, c31);\n";
+    output << "}\n\n";
+    output << "static void mat_mul_edge(const Mat& a, const Mat& b, Mat& c, size_t i0, size_t i1,\n";
+    output << "                         size_t j0, size_t j1, size_t k0, size_t k1) {\n";
+    output << "    for (size_t i = i0; i < i1; i++) {\n";
+    output << "        float* crow = c.row(i);\n";
+    output << "        for (size_t k = k0; k < k1; k++) {\n";
+    output << "            float av = a.row(i)[k];\n";
+    output << "            const float* brow = b.row(k);\n";
+    output << "            for (size_t j = j0; j < j1; j++)\n";
+    output << "                crow[j] += av * brow[j];\n";
+    output << "        }\n";
+    output << "    }\n";
+    output << "}\n\n";
+    output << "Mat mat_mul(Arena& arena, const Mat& a, const Mat& b) {\n";
+    output << "    const size_t M = a.rows, K = a.cols, N = b.cols;\n";
+    output << "    Mat result(arena, M, N);\n";
+    output << "    std::memset(result.data, 0, M * N * sizeof(float));\n";
+    emit_elem_count("M * N * K");
+    output << "    size_t row_blocks = (M + MAT_MC - 1) / MAT_MC;\n";
+    output << "    mml_parallel_for(row_blocks, M * N * K, [&](size_t begin, size_t end) {\n";
+    output << "        for (size_t ib = begin; ib < end; ib++) {\n";
+    output << "            size_t i0 = ib * MAT_MC, i1 = std::min(M, i0 + MAT_MC);\n";
+    output << "            for (size_t k0 = 0; k0 < K; k0 += MAT_KC) {\n";
+    output << "                size_t k1 = std::min(K, k0 + MAT_KC);\n";
+    output << "                for (size_t j0 = 0; j0 < N; j0 += MAT_NC) {\n";
+    output << "                    size_t j1 = std::min(N, j0 + MAT_NC);\n";
+    output << "                    size_t i = i0;\n";
+    output << "                    for (; i + MAT_MR <= i1; i += MAT_MR) {\n";
+    output << "                        size_t j = j0;\n";
+    output << "                        for (; j + MAT_NR <= j1; j += MAT_NR)\n";
+    output << "                            mat_mul_tile(a, b, result, i, j, k0, k1);\n";
+    output << "                        mat_mul_edge(a, b, result, i, i + MAT_MR, j, j1, k0, k1);\n";
+    output << "                    }\n";
+    output << "                    mat_mul_edge(a, b, result, i, i1, j0, j1, k0, k1);\n";
+    output << "                }\n";
+    output << "            }\n";
+    output << "        }\n";
+    output << "    });\n";
     output << "    return result;\n";
     output << "}\n\n";
+    output << "void print_mat(std::ostream& out, const Mat& m) {\n";
+    output << "    out << \"[\";\n";
+    output << "    for (size_t i = 0; i < m.rows; i++) {\n";
+    output << "        out << \"[\";\n";
+    output << "        for (size_t j = 0; j < m.cols; j++) {\n";
+    output << "            out << m.row(i)[j];\n";
+    output << "            if (j < m.cols - 1) out << \", \";\n";
+    output << "        }\n";
+    output << "        out << \"]\";\n";
+    output << "        if (i < m.rows - 1) out << \", \";\n";
+    output << "    }\n";
+    output << "    out << \"]\\n\";\n";
+    output << "}\n";
+}
+
+void CodeGen::emit_math_runtime() {
+    if (options.exact_math) {
+        output << "\n#define MML_EXACT_MATH 1\n";
+    }
+    output << "\n";
+    output << "// Element-wise math. The vector forms work on one mml_vf at a time, and the\n";
+    output << "// scalar forms run the same code on lane 0, so a value's result does not\n";
+    output << "// depend on where it sits in a vec. Polynomials are the Cephes single\n";
+    output << "// precision ones. Max error against double-precision libm, measured on\n";
+    output << "// every 11th float of the range (the README lists the same bounds):\n";
+    output << "//   mml_exp            [-87.3, 88.7]                 1.1 ulp; below: 0, above: inf\n";
+    output << "//   mml_log            x > 0, including subnormals   1 ulp; 0: -inf, negative: nan\n";
+    output << "//   mml_sin, mml_cos   |x| <= 64                     2.5 ulp\n";
+    output << "//   mml_sin, mml_cos   64 < |x| <= 8192              absolute error below 1e-7\n";
+    output << "//   mml_sin, mml_cos   larger |x|, NaN               computed with libm\n";
+    output << "//   mml_sqrt, mml_abs  all                           exact\n";
+    output << "// Compiling with MML_EXACT_MATH (mmlc --exact-math) calls libm instead.\n";
+    output << "typedef int32_t mml_vi __attribute__((vector_size(MML_LANES * sizeof(float))));\n\n";
+    output << "static inline mml_vf mml_splat(float x) {\n";
+    output << "    mml_vf v;\n";
+    output << "    for (int i = 0; i < MML_LANES; i++) v[i] = x;\n";
+    output << "    return v;\n";
+    output << "}\n\n";
+    output << "#ifdef MML_EXACT_MATH\n";
+    output << "#define MML_LIBM_LANES(name, fn) \\\n";
+    output << "    static inline mml_vf name(mml_vf x) { \\\n";
+    output << "        for (int i = 0; i < MML_LANES; i++) x[i] = fn(x[i]); \\\n";
+    output << "        return x; \\\n";
+    output << "    }\n";
+    output << "MML_LIBM_LANES(mml_exp_v, std::exp)\n";
+    output << "MML_LIBM_LANES(mml_log_v, std::log)\n";
+    output << "MML_LIBM_LANES(mml_sin_v, std::sin)\n";
+    output << "MML_LIBM_LANES(mml_cos_v, std::cos)\n";
+    output << "#else\n";
+    output << "static inline mml_vf mml_select(mml_vi mask, mml_vf a, mml_vf b) {\n";
+    output << "    return (mml_vf)((mask & (mml_vi)a) | (~mask & (mml_vi)b));\n";
+    output << "}\n\n";
+    output << "// Rounds to the nearest integer (|x| < 2^22): returns it as float and int\n";
+    output << "static inline mml_vf mml_round(mml_vf x, mml_vi& n) {\n";
+    output << "    const mml_vf magic = mml_splat(12582912.0f); // 1.5 * 2^23\n";
+    output << "    mml_vf t = x + magic;\n";
+    output << "    n = (mml_vi)t - (mml_vi)magic;\n";
+    output << "    return t - magic;\n";
+    output << "}\n\n";
+    output << "static inline mml_vf mml_exp_v(mml_vf x) {\n";
+    output << "    mml_vi n;\n";
+    output << "    mml_vf k = mml_round(x * 1.44269504088896341f, n);\n";
+    output << "    mml_vf r = x - k * 0.693359375f;\n";
+    output << "    r = r - k * -2.12194440e-4f;\n";
+    output << "    mml_vf p = mml_splat(1.9875691500e-4f);\n";
+    output << "    p = p * r + 1.3981999507e-3f;\n";
+    output << "    p = p * r + 8.3334519073e-3f;\n";
+    output << "    p = p * r + 4.1665795894e-2f;\n";
+    output << "    p = p * r + 1.6666665459e-1f;\n";
+    output << "    p = p * r + 5.0000001201e-1f;\n";
+    output << "    p = p * r * r + r + 1.0f;\n";
+    output << "    // 2^n in two steps so n = 128 (x near the overflow threshold) still works\n";
+    output << "    mml_vi half = n >> 1;\n";
+    output << "    mml_vf scale1 = (mml_vf)((half + 127) << 23);\n";
+    output << "    mml_vf scale2 = (mml_vf)((n - half + 127) << 23);\n";
+    output << "    mml_vf result = p * scale1 * scale2;\n";
+    output << "    result = mml_select(x > 88.7228391f, mml_splat(INFINITY), result);\n";
+    output << "    result = mml_select(x < -87.3365448f, mml_splat(0.0f), result);\n";
+    output << "    return mml_select(x != x, x, result);\n";
+    output << "}\n\n";
+    output << "static inline mml_vf mml_log_v(mml_vf x) {\n";
+    output << "    // Subnormals are scaled into the normal range first\n";
+    output << "    mml_vi tiny = x < 1.17549435e-38f;\n";
+    output << "    mml_vf scaled = mml_select(tiny, x * 8388608.0f, x);\n";
+    output << "    mml_vi bits = (mml_vi)scaled;\n";
+    output << "    mml_vi e = ((bits >> 23) & 0xff) - 126;\n";
+    output << "    e = e - (tiny & 23);\n";
+    output << "    mml_vf m = (mml_vf)((bits & 0x007fffff) | 0x3f000000); // [0.5, 1)\n";
+    output << "    mml_vi small = m < 0.707106781186547524f;\n";
+    output << "    e = e + small; // small is -1 where true\n";
+    output << "    m = mml_select(small, m + m, m) - 1.0f;\n";
+    output << "    mml_vf fe = __builtin_convertvector(e, mml_vf);\n\n";
+    output << "    mml_vf z = m * m;\n";
+    output << "    mml_vf p = mml_splat(7.0376836292e-2f);\n";
+    output << "    p = p * m - 1.1514610310e-1f;\n";
+    output << "    p = p * m + 1.1676998740e-1f;\n";
+    output << "    p = p * m - 1.2420140846e-1f;\n";
+    output << "    p = p * m + 1.4249322787e-1f;\n";
+    output << "    p = p * m - 1.6668057665e-1f;\n";
+    output << "    p = p * m + 2.0000714765e-1f;\n";
+    output << "    p = p * m - 2.4999993993e-1f;\n";
+    output << "    p = p * m + 3.3333331174e-1f;\n";
+    output << "    mml_vf y = p * m * z;\n";
+    output << "    y = y + fe * -2.12194440e-4f;\n";
+    output << "    y = y - z * 0.5f;\n";
+    output << "    mml_vf result = m + y + fe * 0.693359375f;\n\n";
+    output << "    result = mml_select(x == INFINITY, x, result);\n";
+    output << "    result = mml_select(x == 0.0f, mml_splat(-INFINITY), result);\n";
+    output << "    result = mml_select(x < 0.0f, mml_splat(NAN), result);\n";
+    output << "    return mml_select(x != x, x, result);\n";
+    output << "}\n\n";
+    output << "// Shared sin/cos core: reduces by pi/4 into an octant and evaluates the sin\n";
+    output << "// or cos polynomial on each lane as the octant requires\n";
+    output << "static inline mml_vf mml_sincos_v(mml_vf x, int quadrant_shift) {\n";
+    output << "    mml_vf ax = (mml_vf)((mml_vi)x & 0x7fffffff);\n";
+    output << "    mml_vi j = __builtin_convertvector(ax * 1.27323954473516f, mml_vi);\n";
+    output << "    j = (j + 1) & ~1;\n";
+    output << "    mml_vf y = __builtin_convertvector(j, mml_vf);\n";
+    output << "    j = j + quadrant_shift;\n\n";
+    output << "    mml_vf r = ((ax - y * 0.78515625f) - y * 2.4187564849853515625e-4f) - y * 3.77489497744594108e-8f;\n";
+    output << "    mml_vf z = r * r;\n";
+    output << "    mml_vf c = mml_splat(2.443315711809948e-5f);\n";
+    output << "    c = c * z - 1.388731625493765e-3f;\n";
+    output << "    c = c * z + 4.166664568298827e-2f;\n";
+    output << "    c = c * z * z - z * 0.5f + 1.0f;\n";
+    output << "    mml_vf s = mml_splat(-1.9515295891e-4f);\n";
+    output << "    s = s * z + 8.3321608736e-3f;\n";
+    output << "    s = s * z - 1.6666654611e-1f;\n";
+    output << "    s = s * z * r + r;\n\n";
+    output << "    mml_vf result = mml_select((j & 2) == 0, s, c);\n";
+    output << "    mml_vi negate = (j & 4) << 29;\n";
+    output << "    if (quadrant_shift == 0) {\n";
+    output << "        negate = negate ^ ((mml_vi)x & (mml_vi)mml_splat(-0.0f)); // sin is odd\n";
+    output << "    }\n";
+    output << "    return (mml_vf)((mml_vi)result ^ negate);\n";
+    output << "}\n\n";
+    output << "static inline mml_vf mml_trig_v(mml_vf x, int quadrant_shift, float (*libm)(float)) {\n";
+    output << "    mml_vf result = mml_sincos_v(x, quadrant_shift);\n";
+    output << "    mml_vi large = ((mml_vf)((mml_vi)x & 0x7fffffff) > 8192.0f) | (x != x);\n";
+    output << "    for (int i = 0; i < MML_LANES; i++) {\n";
+    output << "        if (large[i]) result[i] = libm(x[i]);\n";
+    output << "    }\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "static inline mml_vf mml_sin_v(mml_vf x) { return mml_trig_v(x, 0, std::sin); }\n";
+    output << "static inline mml_vf mml_cos_v(mml_vf x) { return mml_trig_v(x, 2, std::cos); }\n";
+    output << "#endif\n\n";
+    output << "static inline mml_vf mml_sqrt_v(mml_vf x) {\n";
+    output << "    for (int i = 0; i < MML_LANES; i++) x[i] = __builtin_sqrtf(x[i]);\n";
+    output << "    return x;\n";
+    output << "}\n\n";
+    output << "static inline mml_vf mml_abs_v(mml_vf x) {\n";
+    output << "    return (mml_vf)((mml_vi)x & 0x7fffffff);\n";
+    output << "}\n\n";
+    output << "#define MML_MATH_FUNCTION(name) \\\n";
+    output << "    static inline float mml_##name(float x) { return mml_##name##_v(mml_splat(x))[0]; } \\\n";
+    output << "    Vec vec_##name(Vec result, const Vec& v) { \\\n";
+    if (options.instrument) {
+        output << "        prof_elems += v.size; \\\n";
+    }
+    output << "        size_t i = 0; \\\n";
+    output << "        if (v.stride == 1) \\\n";
+    output << "            for (; i + MML_LANES <= v.size; i += MML_LANES) \\\n";
+    output << "                mml_store(result.data + i, mml_##name##_v(mml_load(v.data + i))); \\\n";
+    output << "        /* the tail, or every chunk of a strided slice, goes through lanes */ \\\n";
+    output << "        for (; i < v.size; i += MML_LANES) { \\\n";
+    output << "            size_t n = std::min<size_t>(MML_LANES, v.size - i); \\\n";
+    output << "            float lanes[MML_LANES] = {}; \\\n";
+    output << "            for (size_t l = 0; l < n; l++) lanes[l] = v[i + l]; \\\n";
+    output << "            mml_store(lanes, mml_##name##_v(mml_load(lanes))); \\\n";
+    output << "            std::memcpy(result.data + i, lanes, n * sizeof(float)); \\\n";
+    output << "        } \\\n";
+    output << "        return result; \\\n";
+    output << "    }\n";
+    output << "MML_MATH_FUNCTION(sqrt)\n";
+    output << "MML_MATH_FUNCTION(exp)\n";
+    output << "MML_MATH_FUNCTION(log)\n";
+    output << "MML_MATH_FUNCTION(sin)\n";
+    output << "MML_MATH_FUNCTION(cos)\n";
+    output << "MML_MATH_FUNCTION(abs)\n";
+}
 
-    output << "void print_vec(const Vec& v) {\n";
-    output << "    std::cout << \"[\";\n";
+void CodeGen::emit_sparse_runtime() {
+    output << "\n";
+    output << "// Sparse vector: nnz (index, value) pairs with strictly increasing indices\n";
+    output << "// below size. Index arrays are never written once built, so results with the\n";
+    output << "// sparsity pattern of an operand share its index array.\n";
+    output << "struct SVec {\n";
+    output << "    const uint32_t* index;\n";
+    output << "    float* value;\n";
+    output << "    size_t nnz;\n";
+    output << "    size_t size;\n";
+    output << "    SVec() : index(nullptr), value(nullptr), nnz(0), size(0) {}\n";
+    output << "    SVec(Arena& arena, size_t capacity, size_t s) : nnz(0), size(s) {\n";
+    output << "        index = (uint32_t*)arena.allocate(capacity * sizeof(uint32_t));\n";
+    output << "        value = (float*)arena.allocate(capacity * sizeof(float));\n";
+    output << "    }\n";
+    output << "    // Wraps existing arrays; static ones (sparse literals) are never written to\n";
+    output << "    SVec(const uint32_t* i, const float* v, size_t n, size_t s)\n";
+    output << "        : index(i), value(const_cast<float*>(v)), nnz(n), size(s) {}\n";
+    output << "};\n\n";
+    output << "// a + sign * b: merge over the union of the index lists\n";
+    output << "SVec svec_merge(Arena& arena, const SVec& a, const SVec& b, float sign) {\n";
+    emit_elem_count("a.nnz + b.nnz");
+    output << "    SVec result(arena, a.nnz + b.nnz, a.size);\n";
+    output << "    uint32_t* index = const_cast<uint32_t*>(result.index);\n";
+    output << "    size_t i = 0, j = 0, n = 0;\n";
+    output << "    while (i < a.nnz && j < b.nnz) {\n";
+    output << "        if (a.index[i] < b.index[j]) {\n";
+    output << "            index[n] = a.index[i];\n";
+    output << "            result.value[n++] = a.value[i++];\n";
+    output << "        } else if (b.index[j] < a.index[i]) {\n";
+    output << "            index[n] = b.index[j];\n";
+    output << "            result.value[n++] = sign * b.value[j++];\n";
+    output << "        } else {\n";
+    output << "            index[n] = a.index[i];\n";
+    output << "            result.value[n++] = a.value[i++] + sign * b.value[j++];\n";
+    output << "        }\n";
+    output << "    }\n";
+    output << "    for (; i < a.nnz; i++, n++) {\n";
+    output << "        index[n] = a.index[i];\n";
+    output << "        result.value[n] = a.value[i];\n";
+    output << "    }\n";
+    output << "    for (; j < b.nnz; j++, n++) {\n";
+    output << "        index[n] = b.index[j];\n";
+    output << "        result.value[n] = sign * b.value[j];\n";
+    output << "    }\n";
+    output << "    result.nnz = n;\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "SVec svec_add(Arena& arena, const SVec& a, const SVec& b) { return svec_merge(arena, a, b, 1.0f); }\n";
+    output << "SVec svec_sub(Arena& arena, const SVec& a, const SVec& b) { return svec_merge(arena, a, b, -1.0f); }\n\n";
+    output << "// Element-wise product: merge over the intersection of the index lists\n";
+    output << "SVec svec_mul(Arena& arena, const SVec& a, const SVec& b) {\n";
+    emit_elem_count("a.nnz + b.nnz");
+    output << "    SVec result(arena, std::min(a.nnz, b.nnz), a.size);\n";
+    output << "    uint32_t* index = const_cast<uint32_t*>(result.index);\n";
+    output << "    size_t i = 0, j = 0, n = 0;\n";
+    output << "    while (i < a.nnz && j < b.nnz) {\n";
+    output << "        if (a.index[i] < b.index[j]) {\n";
+    output << "            i++;\n";
+    output << "        } else if (b.index[j] < a.index[i]) {\n";
+    output << "            j++;\n";
+    output << "        } else {\n";
+    output << "            index[n] = a.index[i];\n";
+    output << "            result.value[n++] = a.value[i++] * b.value[j++];\n";
+    output << "        }\n";
+    output << "    }\n";
+    output << "    result.nnz = n;\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "SVec svec_scalar_mul(Arena& arena, const SVec& a, float s) {\n";
+    emit_elem_count("a.nnz");
+    output << "    SVec result(a.index, (float*)arena.allocate(a.nnz * sizeof(float)), a.nnz, a.size);\n";
+    output << "    for (size_t k = 0; k < a.nnz; k++)\n";
+    output << "        result.value[k] = a.value[k] * s;\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "// Gather kernels: a op v at the non-zeros of a, keeping its pattern\n";
+    output << "SVec svec_gather_mul(Arena& arena, const SVec& a, const Vec& v) {\n";
+    emit_elem_count("a.nnz");
+    output << "    SVec result(a.index, (float*)arena.allocate(a.nnz * sizeof(float)), a.nnz, a.size);\n";
+    output << "    for (size_t k = 0; k < a.nnz; k++)\n";
+    output << "        result.value[k] = a.value[k] * v[a.index[k]];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "SVec svec_gather_div(Arena& arena, const SVec& a, const Vec& v) {\n";
+    emit_elem_count("a.nnz");
+    output << "    SVec result(a.index, (float*)arena.allocate(a.nnz * sizeof(float)), a.nnz, a.size);\n";
+    output << "    for (size_t k = 0; k < a.nnz; k++)\n";
+    output << "        result.value[k] = a.value[k] / v[a.index[k]];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "// Scatter kernel: result = vs * v + ss * s; result may be v's buffer\n";
+    output << "Vec vec_axpy_svec(Vec result, const Vec& v, float vs, const SVec& s, float ss) {\n";
+    emit_elem_count("v.size + s.nnz");
+    output << "    for (size_t i = 0; i < v.size; i++)\n";
+    output << "        result.data[i] = vs * v[i];\n";
+    output << "    for (size_t k = 0; k < s.nnz; k++)\n";
+    output << "        result[s.index[k]] += ss * s.value[k];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "Vec svec_to_dense(Arena& arena, const SVec& s) {\n";
+    emit_elem_count("s.size");
+    output << "    Vec result(arena, s.size);\n";
+    output << "    std::memset(result.data, 0, s.size * sizeof(float));\n";
+    output << "    for (size_t k = 0; k < s.nnz; k++)\n";
+    output << "        result[s.index[k]] = s.value[k];\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "SVec vec_to_sparse(Arena& arena, const Vec& v) {\n";
+    emit_elem_count("v.size");
+    output << "    size_t nnz = 0;\n";
+    output << "    for (size_t i = 0; i < v.size; i++)\n";
+    output << "        nnz += v[i] != 0.0f;\n";
+    output << "    SVec result(arena, nnz, v.size);\n";
+    output << "    uint32_t* index = const_cast<uint32_t*>(result.index);\n";
     output << "    for (size_t i = 0; i < v.size; i++) {\n";
-    output << "        std::cout << v.data[i];\n";
-    output << "        if (i < v.size - 1) std::cout << \", \";\n";
+    output << "        if (v[i] != 0.0f) {\n";
+    output << "            index[result.nnz] = (uint32_t)i;\n";
+    output << "            result.value[result.nnz++] = v[i];\n";
+    output << "        }\n";
     output << "    }\n";
-    output << "    std::cout << \"]\" << std::endl;\n";
+    output << "    return result;\n";
+    output << "}\n\n";
+    output << "void print_svec(std::ostream& out, const SVec& s) {\n";
+    output << "    out << \"{\" << s.size << \" |\";\n";
+    output << "    for (size_t k = 0; k < s.nnz; k++) {\n";
+    output << "        out << (k == 0 ? \" \" : \", \") << s.index[k] << \": \" << s.value[k];\n";
+    output << "    }\n";
+    output << "    out << \"}\\n\";\n";
     output << "}\n";
+    if (uses_matrices) {
+        output << "\n";
+        output << "// Matrix times sparse vector: each row gathers only the columns in s.index\n";
+        output << "Vec mat_svec_mul(Arena& arena, const Mat& a, const SVec& s) {\n";
+        emit_elem_count("a.rows * s.nnz");
+        output << "    Vec result(arena, a.rows);\n";
+        output << "    for (size_t i = 0; i < a.rows; i++) {\n";
+        output << "        const float* row = a.row(i);\n";
+        output << "        float sum = 0.0f;\n";
+        output << "        for (size_t k = 0; k < s.nnz; k++)\n";
+        output << "            sum += row[s.index[k]] * s.value[k];\n";
+        output << "        result[i] = sum;\n";
+        output << "    }\n";
+        output << "    return result;\n";
+        output << "}\n";
+    }
 }
 
-void CodeGen::generate_statement(ASTNode* node) {
-    switch (node->node_type) {
-    case NodeType::VAR_DECL:
-        generate_var_decl(static_cast<VarDecl*>(node));
+void CodeGen::emit_profiler_runtime() {
+    output << "// Per-statement profiler (--instrument)\n";
+    output << "static inline uint64_t prof_ticks() {\n";
+    output << "#if defined(__x86_64__) || defined(__i386__)\n";
+    output << "    return __rdtsc();\n";
+    output << "#else\n";
+    output << "    return std::chrono::steady_clock::now().time_since_epoch().count();\n";
+    output << "#endif\n";
+    output << "}\n\n";
+
+    output << "struct ProfSite {\n";
+    output << "    int line;\n";
+    output << "    const char* label;\n";
+    output << "    uint64_t count;\n";
+    output << "    uint64_t ticks;\n";
+    output << "    uint64_t bytes;\n";
+    output << "    uint64_t elems;\n";
+    output << "};\n\n";
+
+    output << "struct ProfMark {\n";
+    output << "    uint64_t ticks;\n";
+    output << "    size_t bytes;\n";
+    output << "    uint64_t elems;\n";
+    output << "};\n\n";
+
+    output << "extern ProfSite prof_sites[];\n";
+    output << "extern const size_t prof_site_count;\n";
+    output << "static thread_local uint64_t prof_elems = 0;\n\n";
+
+    output << "static inline ProfMark prof_begin(const Arena& arena) {\n";
+    output << "    ProfMark mark;\n";
+    output << "    mark.bytes = arena.used();\n";
+    output << "    mark.elems = prof_elems;\n";
+    output << "    mark.ticks = prof_ticks();\n";
+    output << "    return mark;\n";
+    output << "}\n\n";
+
+    output << "static inline void prof_end(ProfSite& site, const ProfMark& mark, const Arena& arena) {\n";
+    output << "    uint64_t now = prof_ticks();\n";
+    output << "    // Relaxed atomics: batch workers may share a site\n";
+    output << "    __atomic_fetch_add(&site.count, 1, __ATOMIC_RELAXED);\n";
+    output << "    __atomic_fetch_add(&site.ticks, now - mark.ticks, __ATOMIC_RELAXED);\n";
+    output << "    __atomic_fetch_add(&site.bytes, arena.used() - mark.bytes, __ATOMIC_RELAXED);\n";
+    output << "    __atomic_fetch_add(&site.elems, prof_elems - mark.elems, __ATOMIC_RELAXED);\n";
+    output << "}\n\n";
+
+    output << "void prof_dump() {\n";
+    output << "    std::vector<ProfSite*> sites;\n";
+    output << "    uint64_t total = 0;\n";
+    output << "    for (size_t i = 0; i < prof_site_count; i++) {\n";
+    output << "        sites.push_back(&prof_sites[i]);\n";
+    output << "        total += prof_sites[i].ticks;\n";
+    output << "    }\n";
+    output << "    std::stable_sort(sites.begin(), sites.end(), [](const ProfSite* a, const ProfSite* b) {\n";
+    output << "        return a->ticks > b->ticks;\n";
+    output << "    });\n";
+    output << "    std::fprintf(stderr, \"\\n=== MiniMathLang profile (sorted by cost) ===\\n\");\n";
+    output << "    std::fprintf(stderr, \"%6s  %-24s %8s %14s %7s %14s %14s\\n\",\n";
+    output << "                 \"line\", \"statement\", \"count\", \"ticks\", \"%\", \"arena bytes\", \"vec elems\");\n";
+    output << "    for (const ProfSite* s : sites) {\n";
+    output << "        double pct = total ? 100.0 * (double)s->ticks / (double)total : 0.0;\n";
+    output << "        std::fprintf(stderr, \"%6d  %-24s %8llu %14llu %6.2f%% %14llu %14llu\\n\",\n";
+    output << "                     s->line, s->label, (unsigned long long)s->count,\n";
+    output << "                     (unsigned long long)s->ticks, pct,\n";
+    output << "                     (unsigned long long)s->bytes, (unsigned long long)s->elems);\n";
+    output << "    }\n";
+    output << "}\n\n";
+}
+
+void CodeGen::emit_profiler_sites() {
+    output << "\n";
+    if (prof_sites.empty()) {
+        output << "ProfSite prof_sites[1] = {};\n";
+    } else {
+        output << "ProfSite prof_sites[] = {\n";
+        for (const ProfSiteInfo& site : prof_sites) {
+            output << "    {" << site.line << ", \"" << site.label << "\", 0, 0, 0, 0},\n";
+        }
+        output << "};\n";
+    }
+    output << "const size_t prof_site_count = " << prof_sites.size() << ";\n";
+}
+
+// Every fn specialisation becomes a C++ function of its parameters, so g++
+// sees each call's body inline. An element-wise one takes mml_vf lanes for
+// its vec parameters and comes with a map function: one loop over all the
+// vec arguments that evaluates the whole body a vector register at a time,
+// instead of one runtime kernel and temporary per operator.
+void CodeGen::emit_kernels() {
+    for (FnDecl* fn : ir->functions) {
+        for (size_t k = 0; k < fn->specialisations.size(); k++) {
+            emit_kernel(fn, k);
+        }
+    }
+}
+
+void CodeGen::emit_kernel(FnDecl* fn, size_t specialisation) {
+    const FnDecl::Specialisation& spec = fn->specialisations[specialisation];
+    std::string name = kernel_name(fn, specialisation);
+    std::set<std::string> used;
+    ASTNode* body_root = spec.body;
+    visit_postorder(body_root, [&used](ASTNode*& node) {
+        if (node->node_type == NodeType::IDENTIFIER) used.insert(static_cast<Identifier*>(node)->name);
+    });
+    std::string signature;
+    std::string params;
+    for (size_t i = 0; i < spec.types.size(); i++) {
+        Type type = spec.types[i];
+        signature += (i ? ", " : "") + type_to_string(type);
+        params += (i ? ", " : "") + std::string(used.count(fn->params[i].name) ? "" : "[[maybe_unused]] ") +
+                  (type == Type::VEC ? std::string("mml_vf") : cpp_type(type)) + " " +
+                  variable_name(fn->params[i].name);
+    }
+    std::string body = generate_kernel_body(spec.body);
+
+    output << "\n// fn " << fn->name << "(" << signature << ")\n";
+    if (!spec.elementwise) {
+        output << "static inline " << cpp_type(spec.body->type) << " " << name << "(" << params << ") {\n";
+        output << "    return " << body << ";\n";
+        output << "}\n";
+        return;
+    }
+    if (spec.body->type != Type::VEC) {
+        body = "mml_vf() + (float)" + body; // the same in every lane
+    }
+    output << "static inline mml_vf " << name << "(" << params << ") {\n";
+    output << "    return " << body << ";\n";
+    output << "}\n\n";
+
+    std::string map_params;
+    std::string contiguous;
+    std::string load_args;
+    std::string lane_args;
+    std::vector<size_t> vec_params;
+    for (size_t i = 0; i < spec.types.size(); i++) {
+        std::string arg = "a" + std::to_string(i);
+        std::string sep = i ? ", " : "";
+        if (spec.types[i] == Type::VEC) {
+            map_params += ", const Vec& " + arg;
+            contiguous += (contiguous.empty() ? "" : " && ") + arg + ".stride == 1";
+            load_args += sep + "mml_load(" + arg + ".data + i)";
+            lane_args += sep + "mml_load(lanes" + std::to_string(i) + ")";
+            vec_params.push_back(i);
+        } else {
+            map_params += ", " + cpp_type(spec.types[i]) + " " + arg;
+            load_args += sep + arg;
+            lane_args += sep + arg;
+        }
+    }
+
+    output << "Vec " << name << "_map(Vec result" << map_params << ") {\n";
+    emit_elem_count("result.size");
+    output << "    size_t i = 0;\n";
+    output << "    if (" << contiguous << ")\n";
+    output << "        for (; i + MML_LANES <= result.size; i += MML_LANES)\n";
+    output << "            mml_store(result.data + i, " << name << "(" << load_args << "));\n";
+    output << "    // the tail, or every chunk of a strided slice, goes through lanes\n";
+    output << "    for (; i < result.size; i += MML_LANES) {\n";
+    output << "        size_t n = std::min<size_t>(MML_LANES, result.size - i);\n";
+    for (size_t v : vec_params) {
+        output << "        float lanes" << v << "[MML_LANES] = {};\n";
+    }
+    output << "        for (size_t l = 0; l < n; l++) {\n";
+    for (size_t v : vec_params) {
+        output << "            lanes" << v << "[l] = a" << v << "[i + l];\n";
+    }
+    output << "        }\n";
+    output << "        float lanes[MML_LANES];\n";
+    output << "        mml_store(lanes, " << name << "(" << lane_args << "));\n";
+    output << "        std::memcpy(result.data + i, lanes, n * sizeof(float));\n";
+    output << "    }\n";
+    output << "    return result;\n";
+    output << "}\n";
+}
+
+// One C++ expression for a typed fn body. Vec-typed nodes are mml_vf lanes;
+// GCC's vector extension broadcasts float operands, and int ones are
+// converted first, as the vec runtime kernels do.
+std::string CodeGen::generate_kernel_body(ASTNode* body) {
+    std::vector<std::string> values;
+    visit_postorder(body, [this, &values](ASTNode*& node) {
+        std::string code;
+        switch (node->node_type) {
+        case NodeType::LITERAL_INT:
+            code = generate_literal_int(static_cast<LiteralInt*>(node));
+            break;
+        case NodeType::LITERAL_FLOAT:
+            code = generate_literal_float(static_cast<LiteralFloat*>(node));
+            break;
+        case NodeType::IDENTIFIER:
+            code = variable_name(static_cast<Identifier*>(node)->name);
+            break;
+        case NodeType::BINARY_OP: {
+            BinaryOp* binop = static_cast<BinaryOp*>(node);
+            std::string right = std::move(values.back());
+            values.pop_back();
+            std::string left = std::move(values.back());
+            values.pop_back();
+            if (binop->type == Type::VEC && binop->left->type == Type::INT) left = "(float)" + left;
+            if (binop->type == Type::VEC && binop->right->type == Type::INT) right = "(float)" + right;
+            code = "(" + left + " " + binop->op + " " + right + ")";
+            break;
+        }
+        case NodeType::CALL: {
+            Call* call = static_cast<Call*>(node);
+            size_t argc = call->args.size();
+            std::string args;
+            for (size_t i = values.size() - argc; i < values.size(); i++) {
+                args += (args.empty() ? "" : ", ") + values[i];
+            }
+            values.resize(values.size() - argc);
+            if (call->fn) {
+                code = kernel_name(call->fn, call->specialisation) + "(" + args + ")";
+            } else if (call->type == Type::VEC) {
+                code = "mml_" + call->name + "_v(" + args + ")";
+            } else if (call->type == Type::INT) {
+                code = "std::abs(" + args + ")";
+            } else {
+                code = "mml_" + call->name + "(" + args + ")";
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        values.push_back(std::move(code));
+    });
+    return values.back();
+}
+
+void CodeGen::emit_elem_count(const std::string& count) {
+    if (options.instrument) {
+        output << "    prof_elems += " << count << ";\n";
+    }
+}
+
+// Lowers the instructions of one statement, which start at next
+void CodeGen::generate_statement(size_t statement, size_t& next) {
+    const IRStatement& info = ir->statements[statement];
+    bool profiled = options.instrument &&
+        (info.kind == NodeType::VAR_DECL || info.kind == NodeType::PRINT_STMT);
+    size_t site = prof_sites.size();
+
+    if (profiled) {
+        std::string label = info.kind == NodeType::VAR_DECL ? "let " + info.name : "print";
+        prof_sites.push_back({info.line, label});
+        output << "    ProfMark _pm" << site << " = prof_begin(arena);\n";
+    }
+
+    for (; next < ir->instructions.size() && ir->instructions[next].statement == statement; next++) {
+        generate_instruction(next);
+    }
+
+    if (profiled) {
+        output << "    prof_end(prof_sites[" << site << "], _pm" << site << ", arena);\n";
+    }
+}
+
+// Sets values[id] to the C++ code of the instruction's value. Scalar code
+// is combined into one C++ expression until it grows past
+// MAX_INLINE_EXPRESSION characters, then spilled into a temporary, so every
+// string stays short and lowering is linear in the size of the program.
+void CodeGen::generate_instruction(size_t id) {
+    const Instruction& inst = ir->instructions[id];
+    std::vector<std::string> operands;
+    for (size_t value : inst.operands) {
+        // The only reader of a value takes its code
+        if (value_uses[value] == 1) {
+            operands.push_back(std::move(values[value]));
+        } else {
+            operands.push_back(values[value]);
+        }
+    }
+
+    std::string code;
+    switch (inst.op) {
+    case Opcode::CONST:
+        switch (inst.node->node_type) {
+        case NodeType::LITERAL_INT:
+            code = generate_literal_int(static_cast<LiteralInt*>(inst.node));
+            break;
+        case NodeType::LITERAL_FLOAT:
+            code = generate_literal_float(static_cast<LiteralFloat*>(inst.node));
+            break;
+        case NodeType::LITERAL_VEC:
+            code = generate_literal_vec(static_cast<LiteralVec*>(inst.node));
+            break;
+        case NodeType::LITERAL_MAT:
+            code = generate_literal_mat(static_cast<LiteralMat*>(inst.node));
+            break;
+        default:
+            code = generate_literal_svec(static_cast<LiteralSVec*>(inst.node));
+            break;
+        }
         break;
-    case NodeType::PRINT_STMT:
-        generate_print_stmt(static_cast<PrintStmt*>(node));
+    case Opcode::INPUT:
+        generate_input(id);
+        code = variable_name(inst.name);
         break;
-    default:
+    case Opcode::LET:
+        generate_let(id, operands[0]);
+        code = variable_name(inst.name);
+        break;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+        code = generate_binary_op(inst, std::move(operands[0]), std::move(operands[1]));
+        if (code.size() > MAX_INLINE_EXPRESSION) {
+            code = spill(inst.type, code);
+        }
+        break;
+    case Opcode::CALL:
+        code = generate_call(inst, operands);
+        break;
+    case Opcode::SLICE:
+        code = generate_slice(inst, operands);
+        break;
+    case Opcode::PRINT:
+        generate_print(inst, operands[0]);
         break;
     }
+    values[id] = std::move(code);
 }
 
-std::string CodeGen::generate_expression(ASTNode* node) {
-    switch (node->node_type) {
-    case NodeType::BINARY_OP:
-        return generate_binary_op(static_cast<BinaryOp*>(node));
-    case NodeType::LITERAL_INT:
-        return generate_literal_int(static_cast<LiteralInt*>(node));
-    case NodeType::LITERAL_FLOAT:
-        return generate_literal_float(static_cast<LiteralFloat*>(node));
-    case NodeType::LITERAL_VEC:
-        return generate_literal_vec(static_cast<LiteralVec*>(node));
-    case NodeType::IDENTIFIER:
-        return generate_identifier(static_cast<Identifier*>(node));
-    default:
-        return "";
-    }
+const Instruction& CodeGen::operand(const Instruction& inst, size_t i) const {
+    return ir->instructions[inst.operands[i]];
 }
 
-std::string CodeGen::generate_binary_op(BinaryOp* node) {
-    std::string left = generate_expression(node->left);
-    std::string right = generate_expression(node->right);
+std::string CodeGen::generate_binary_op(const Instruction& inst, std::string left, std::string right) {
+    const Instruction& lhs = operand(inst, 0);
+    const Instruction& rhs = operand(inst, 1);
+    Type left_type = lhs.type;
+    Type right_type = rhs.type;
+    char op = binary_operator(inst.op);
+    check_lengths(inst, left, right);
+
+    if (left_type == Type::SVEC || right_type == Type::SVEC) {
+        return generate_sparse_op(inst, left, right);
+    }
 
-    Type left_type = node->left->type;
-    Type right_type = node->right->type;
+    if (left_type == Type::MAT || right_type == Type::MAT) {
+        if (left_type == Type::MAT && right_type == Type::MAT) {
+            std::string func = op == '+' ? "mat_add" : op == '-' ? "mat_sub" : "mat_mul";
+            return func + "(arena, " + left + ", " + right + ")";
+        }
+        if (right_type == Type::VEC) {
+            std::string temp = new_temp();
+            output << "    Vec " << temp << " = mat_vec_mul(arena, " << left << ", " << right << ");\n";
+            release_if_dead(right);
+            new_buffer(temp, 1);
+            return temp;
+        }
+        std::string mat_expr = (left_type == Type::MAT) ? left : right;
+        std::string scalar_expr = (left_type == Type::MAT) ? right : left;
+        return "mat_scalar_mul(arena, " + mat_expr + ", " + scalar_expr + ")";
+    }
 
     if (left_type == Type::VEC && right_type == Type::VEC) {
         std::string func;
-        switch (node->op) {
+        switch (op) {
         case '+': func = "vec_add"; break;
         case '-': func = "vec_sub"; break;
         case '*': func = "vec_mul"; break;
         case '/': func = "vec_div"; break;
         }
-        return func + "(arena, " + left + ", " + right + ")";
+        bool same_size = lhs.shape.known && rhs.shape.known && lhs.shape.rows == rhs.shape.rows;
+        return generate_vec_op(func, left, right, true, same_size);
     }
 
     if (left_type == Type::VEC || right_type == Type::VEC) {
-        if (node->op == '*' || node->op == '+') {
+        if (op == '*' || op == '+') {
             std::string vec_expr = (left_type == Type::VEC) ? left : right;
             std::string scalar_expr = (left_type == Type::VEC) ? right : left;
-            std::string func = (node->op == '*') ? "vec_scalar_mul" : "vec_scalar_add";
-            return func + "(arena, " + vec_expr + ", " + scalar_expr + ")";
+            std::string func = (op == '*') ? "vec_scalar_mul" : "vec_scalar_add";
+            return generate_vec_op(func, vec_expr, scalar_expr, false, false);
+        }
+    }
+
+    return "(" + left + " " + op + " " + right + ")";
+}
+
+// Emits one element-wise vec operation into a temporary; b is the second
+// argument (vec, scalar or several), empty for unary kernels. The result
+// takes over the buffer of an operand that dies here when there is one;
+// otherwise it is allocated from the arena, which prefers released buffers.
+std::string CodeGen::generate_vec_op(const std::string& func, const std::string& a, const std::string& b,
+                                     bool b_is_vec, bool same_size) {
+    bool a_dead = consume(a);
+    bool b_dead = b_is_vec && consume(b);
+    std::string temp = new_temp();
+
+    // Only an operand spanning its whole buffer can take the result
+    std::string dest;
+    if (a_dead && !views.count(a)) {
+        dest = a;
+    } else if (b_dead && same_size && !views.count(b)) {
+        dest = b;
+    }
+
+    std::string rest = b.empty() ? "" : ", " + b;
+    if (dest.empty()) {
+        output << "    Vec " << temp << " = " << func << "(Vec(arena, " << a << ".size), " << a << rest << ");\n";
+        new_buffer(temp, 1);
+    } else {
+        output << "    Vec " << temp << " = " << func << "(" << dest << ", " << a << rest << ");\n";
+        size_t buffer = buffer_of[dest];
+        kill_buffer(buffer);
+        buffer_of[temp] = buffer;
+        buffer_uses[buffer] = 1;
+        buffer_owner[buffer] = {temp, current_task, true};
+    }
+
+    if (a_dead && dest != a) {
+        release_buffer(buffer_of[a]);
+    }
+    if (b_dead && dest != b && buffer_of[b] != buffer_of[temp]) {
+        release_buffer(buffer_of[b]);
+    }
+    return temp;
+}
+
+// Operations with a sparse operand; see TypeChecker::infer_sparse_op for
+// which results are sparse
+std::string CodeGen::generate_sparse_op(const Instruction& inst, const std::string& left, const std::string& right) {
+    Type left_type = operand(inst, 0).type;
+    Type right_type = operand(inst, 1).type;
+    char op = binary_operator(inst.op);
+
+    if (left_type == Type::SVEC && right_type == Type::SVEC) {
+        std::string func = op == '+' ? "svec_add" : op == '-' ? "svec_sub" : "svec_mul";
+        return func + "(arena, " + left + ", " + right + ")";
+    }
+
+    if (left_type == Type::MAT) {
+        std::string temp = new_temp();
+        output << "    Vec " << temp << " = mat_svec_mul(arena, " << left << ", " << right << ");\n";
+        new_buffer(temp, 1);
+        return temp;
+    }
+
+    if (left_type == Type::VEC || right_type == Type::VEC) {
+        const std::string& vec_expr = (left_type == Type::VEC) ? left : right;
+        const std::string& svec_expr = (left_type == Type::SVEC) ? left : right;
+        if (op == '*' || op == '/') {
+            std::string temp = new_temp();
+            std::string func = op == '*' ? "svec_gather_mul" : "svec_gather_div";
+            output << "    SVec " << temp << " = " << func << "(arena, " << svec_expr << ", " << vec_expr << ");\n";
+            release_if_dead(vec_expr);
+            return temp;
+        }
+        // + and -: the dense operand fills the zeros, scaled by the operator's sign
+        std::string vec_scale = (op == '-' && left_type == Type::SVEC) ? "-1.0f" : "1.0f";
+        std::string svec_scale = (op == '-' && right_type == Type::SVEC) ? "-1.0f" : "1.0f";
+        return generate_vec_op("vec_axpy_svec", vec_expr, vec_scale + ", " + svec_expr + ", " + svec_scale,
+                               false, false);
+    }
+
+    std::string svec_expr = (left_type == Type::SVEC) ? left : right;
+    std::string scalar_expr = (left_type == Type::SVEC) ? right : left;
+    return "svec_scalar_mul(arena, " + svec_expr + ", " + scalar_expr + ")";
+}
+
+// dense(svec), sparse(vec) and the element-wise math builtins; the type
+// checker has resolved the name
+std::string CodeGen::generate_call(const Instruction& inst, const std::vector<std::string>& args) {
+    if (static_cast<Call*>(inst.node)->fn) {
+        return generate_fn_call(inst, args);
+    }
+    if (inst.name != "dense" && inst.name != "sparse") {
+        Type arg_type = operand(inst, 0).type;
+        if (arg_type == Type::VEC) {
+            return generate_vec_op("vec_" + inst.name, args[0], "", false, false);
+        }
+        if (arg_type == Type::INT && inst.name == "abs") {
+            return "std::abs(" + args[0] + ")";
+        }
+        return "mml_" + inst.name + "(" + args[0] + ")";
+    }
+
+    std::string temp = new_temp();
+    if (inst.name == "dense") {
+        output << "    Vec " << temp << " = svec_to_dense(arena, " << args[0] << ");\n";
+        new_buffer(temp, 1);
+    } else {
+        output << "    SVec " << temp << " = vec_to_sparse(arena, " << args[0] << ");\n";
+        release_if_dead(args[0]);
+    }
+    return temp;
+}
+
+// A scalar fn call is a call of its inline function. An element-wise one
+// runs the specialisation's map loop into a temporary, which takes over the
+// buffer of a vec argument that dies here when there is one.
+std::string CodeGen::generate_fn_call(const Instruction& inst, const std::vector<std::string>& args) {
+    const Call* call = static_cast<const Call*>(inst.node);
+    const FnDecl::Specialisation& spec = call->fn->specialisations[call->specialisation];
+    std::string name = kernel_name(call->fn, call->specialisation);
+    std::string arg_list;
+    for (size_t i = 0; i < args.size(); i++) {
+        arg_list += (i ? ", " : "") + args[i];
+    }
+    if (!spec.elementwise) {
+        return name + "(" + arg_list + ")";
+    }
+
+    // Lengths the type checker could not compare are checked here
+    size_t first = std::find(spec.types.begin(), spec.types.end(), Type::VEC) - spec.types.begin();
+    for (size_t i = first + 1; i < args.size(); i++) {
+        if (spec.types[i] == Type::VEC && !(operand(inst, first).shape.known && operand(inst, i).shape.known)) {
+            output << "    vec_check_arg_length(" << args[first] << ".size, " << args[i] << ".size, \""
+                   << call->fn->name << "\");\n";
+        }
+    }
+
+    std::vector<bool> dead(args.size(), false);
+    std::string dest;
+    for (size_t i = 0; i < args.size(); i++) {
+        dead[i] = spec.types[i] == Type::VEC && consume(args[i]);
+    }
+    for (size_t i = 0; i < args.size() && dest.empty(); i++) {
+        if (dead[i] && !views.count(args[i])) dest = args[i];
+    }
+
+    std::string temp = new_temp();
+    if (dest.empty()) {
+        output << "    Vec " << temp << " = " << name << "_map(Vec(arena, " << args[first] << ".size), "
+               << arg_list << ");\n";
+        new_buffer(temp, 1);
+    } else {
+        output << "    Vec " << temp << " = " << name << "_map(" << dest << ", " << arg_list << ");\n";
+        size_t buffer = buffer_of[dest];
+        kill_buffer(buffer);
+        buffer_of[temp] = buffer;
+        buffer_uses[buffer] = 1;
+        buffer_owner[buffer] = {temp, current_task, true};
+    }
+
+    for (size_t i = 0; i < args.size(); i++) {
+        if (dead[i] && buffer_of[args[i]] != buffer_of[temp]) {
+            release_buffer(buffer_of[args[i]]);
         }
     }
+    return temp;
+}
+
+// Slices are views: the bounds and stride are applied to the base's data
+// pointer, nothing is copied. operands holds the vec, then the bounds given.
+std::string CodeGen::generate_slice(const Instruction& inst, const std::vector<std::string>& operands) {
+    const Slice* node = static_cast<const Slice*>(inst.node);
+    const std::string& vec = operands[0];
+    std::string temp = new_temp();
+    if (node->static_bounds) {
+        output << "    Vec " << temp << " = vec_view(" << vec << ", " << node->first << ", "
+               << node->count << ", " << node->stride << ");\n";
+    } else {
+        size_t k = 1;
+        std::string start = node->start ? operands[k++] : "0";
+        std::string stop = node->stop ? operands[k++] : vec + ".size";
+        std::string step = node->step ? operands[k++] : "1";
+        output << "    Vec " << temp << " = vec_slice(" << vec << ", " << start << ", " << stop << ", "
+               << step << ", " << node->line << ");\n";
+    }
+    views.insert(temp);
 
-    return "(" + left + " " + node->op + " " + right + ")";
+    // The view keeps the base's buffer alive until its own last use
+    auto it = buffer_of.find(vec);
+    if (it != buffer_of.end()) {
+        buffer_of[temp] = it->second;
+        buffer_uses[it->second]++;
+        consume(vec);
+    }
+    return temp;
 }
 
 std::string CodeGen::generate_literal_int(LiteralInt* node) {
@@ -172,46 +1922,247 @@ std::string CodeGen::generate_literal_int(LiteralInt* node) {
 }
 
 std::string CodeGen::generate_literal_float(LiteralFloat* node) {
-    return std::to_string(node->value) + "f";
+    return format_float(node->value);
 }
 
+// Vector literals become aligned static arrays in .rodata; the Vec borrows
+// them directly, so there is no per-element code and no copy into the arena.
 std::string CodeGen::generate_literal_vec(LiteralVec* node) {
     std::string temp = new_temp();
-    output << "    Vec " << temp << "(arena, " << node->values.size() << ");\n";
-    for (size_t i = 0; i < node->values.size(); i++) {
-        output << "    " << temp << "[" << i << "] = " << std::to_string(node->values[i]) << "f;\n";
+    size_t size = node->size;
+
+    if (size == 0) {
+        output << "    Vec " << temp << "(arena, 0);\n";
+        return temp;
     }
+
+    output << "    alignas(64) static const float " << temp << "_data[" << size << "] = {";
+    for (size_t i = 0; i < size; i++) {
+        output << (i % 8 == 0 ? "\n        " : " ") << format_float(node->values[i]) << ",";
+    }
+    output << "\n    };\n";
+    output << "    Vec " << temp << "(" << temp << "_data, " << size << ");\n";
     return temp;
 }
 
-std::string CodeGen::generate_identifier(Identifier* node) {
-    return node->name;
+std::string CodeGen::generate_literal_mat(LiteralMat* node) {
+    std::string temp = new_temp();
+    size_t size = node->rows * node->cols;
+
+    if (size == 0) {
+        output << "    Mat " << temp << "(arena, " << node->rows << ", " << node->cols << ");\n";
+        return temp;
+    }
+
+    output << "    alignas(64) static const float " << temp << "_data[" << size << "] = {";
+    for (size_t i = 0; i < size; i++) {
+        output << (i % node->cols == 0 ? "\n        " : " ") << format_float(node->values[i]) << ",";
+    }
+    output << "\n    };\n";
+    output << "    Mat " << temp << "(" << temp << "_data, " << node->rows << ", " << node->cols << ");\n";
+    return temp;
 }
 
-void CodeGen::generate_var_decl(VarDecl* node) {
-    std::string type_str;
-    switch (node->var_type) {
-    case Type::INT: type_str = "int"; break;
-    case Type::FLOAT: type_str = "float"; break;
-    case Type::VEC: type_str = "Vec"; break;
-    default: type_str = "auto"; break;
+// Only the non-zeros are stored: static index and value arrays
+std::string CodeGen::generate_literal_svec(LiteralSVec* node) {
+    std::string temp = new_temp();
+
+    if (node->nnz == 0) {
+        output << "    SVec " << temp << "(arena, 0, " << node->size << ");\n";
+        return temp;
     }
 
-    std::string init = generate_expression(node->initializer);
-    output << "    " << type_str << " " << node->name << " = " << init << ";\n";
+    output << "    static const uint32_t " << temp << "_index[" << node->nnz << "] = {";
+    for (size_t k = 0; k < node->nnz; k++) {
+        output << (k % 8 == 0 ? "\n        " : " ") << node->indices[k] << "u,";
+    }
+    output << "\n    };\n";
+    output << "    alignas(64) static const float " << temp << "_value[" << node->nnz << "] = {";
+    for (size_t k = 0; k < node->nnz; k++) {
+        output << (k % 8 == 0 ? "\n        " : " ") << format_float(node->values[k]) << ",";
+    }
+    output << "\n    };\n";
+    output << "    SVec " << temp << "(" << temp << "_index, " << temp << "_value, "
+           << node->nnz << ", " << node->size << ");\n";
+    return temp;
+}
+
+std::string CodeGen::cpp_type(Type type) {
+    switch (type) {
+    case Type::INT: return "int";
+    case Type::FLOAT: return "float";
+    case Type::VEC: return "Vec";
+    case Type::MAT: return "Mat";
+    case Type::SVEC: return "SVec";
+    default: return "auto";
+    }
+}
+
+// A let names its operand's value; in a task graph the variable is
+// declared up front and assigned here
+void CodeGen::generate_let(size_t id, const std::string& init) {
+    const Instruction& inst = ir->instructions[id];
+    std::string name = variable_name(inst.name);
+    if (task_graph) {
+        output << "    " << name << " = " << init << ";\n";
+    } else {
+        output << "    " << unused(id) << cpp_type(inst.type) << " " << name << " = " << init << ";\n";
+    }
+
+    // The variable shares the initializer's buffer, so its uses keep it
+    // alive; a variable bound to a whole buffer becomes its owner
+    if (views.count(init)) {
+        views.insert(name);
+    }
+    auto it = buffer_of.find(init);
+    if (inst.type == Type::VEC && it != buffer_of.end()) {
+        buffer_of[name] = it->second;
+        buffer_uses[it->second] += value_uses[id];
+        if (!views.count(init)) {
+            buffer_owner[it->second] = {name, current_task, false};
+        }
+        release_if_dead(init);
+    }
+}
+
+// Inputs read their slots of the current record in place; vec and mat
+// inputs are zero-copy views into the record buffer.
+void CodeGen::generate_input(size_t id) {
+    const Instruction& inst = ir->instructions[id];
+    size_t offset = input_offset;
+    std::string name = variable_name(inst.name);
+    std::string attribute = unused(id);
+    switch (inst.type) {
+    case Type::INT:
+        output << "    " << attribute << "int " << name << ";\n";
+        output << "    std::memcpy(&" << name << ", mml_in + " << offset << ", sizeof(int));\n";
+        input_offset += 1;
+        break;
+    case Type::FLOAT:
+        output << "    " << attribute << "float " << name << " = mml_in[" << offset << "];\n";
+        input_offset += 1;
+        break;
+    case Type::VEC:
+        output << "    " << attribute << "Vec " << name << "(mml_in + " << offset << ", " << inst.shape.rows << ");\n";
+        input_offset += inst.shape.rows;
+        break;
+    case Type::MAT:
+        output << "    " << attribute << "Mat " << name << "(mml_in + " << offset << ", "
+               << inst.shape.rows << ", " << inst.shape.cols << ");\n";
+        input_offset += inst.shape.rows * inst.shape.cols;
+        break;
+    default:
+        break;
+    }
 }
 
-void CodeGen::generate_print_stmt(PrintStmt* node) {
-    std::string expr = generate_expression(node->expr);
+void CodeGen::generate_print(const Instruction& inst, const std::string& expr) {
+    Type type = operand(inst, 0).type;
 
-    if (node->expr->type == Type::VEC) {
-        output << "    print_vec(" << expr << ");\n";
+    if (type == Type::VEC) {
+        output << "    print_vec(mml_out, " << expr << ");\n";
+        release_if_dead(expr);
+    }
+    else if (type == Type::MAT) {
+        output << "    print_mat(mml_out, " << expr << ");\n";
+    }
+    else if (type == Type::SVEC) {
+        output << "    print_svec(mml_out, " << expr << ");\n";
     }
     else {
-        output << "    std::cout << " << expr << " << std::endl;\n";
+        output << "    mml_out << " << expr << " << '\\n';\n";
     }
 }
 
+// Liveness state for one lowering; IR use counts give the reads of each
+// let ahead of time
+void CodeGen::reset_liveness() {
+    values.assign(ir->instructions.size(), std::string());
+    value_uses = ir->use_counts();
+    buffer_of.clear();
+    buffer_uses.clear();
+    buffer_readers.clear();
+    views.clear();
+    buffer_owner.clear();
+}
+
+// Variables the program never reads are still emitted; the attribute keeps
+// -Wunused from flagging them in the generated code
+std::string CodeGen::unused(size_t id) const {
+    return value_uses[id] == 0 ? "[[maybe_unused]] " : "";
+}
+
+void CodeGen::new_buffer(const std::string& value, int uses) {
+    buffer_of[value] = buffer_uses.size();
+    buffer_uses.push_back(uses);
+    buffer_readers.emplace_back();
+    buffer_owner.push_back({value, current_task, true});
+}
+
+// Records one use of value; true when that was the last use of its buffer
+bool CodeGen::consume(const std::string& value) {
+    auto it = buffer_of.find(value);
+    if (it == buffer_of.end()) return false;
+    if (task_graph) {
+        buffer_readers[it->second].push_back(current_task);
+    }
+    return --buffer_uses[it->second] == 0;
+}
+
+// The current statement overwrites or releases buffer: in a task graph it
+// must run after every statement that read it
+void CodeGen::kill_buffer(size_t buffer) {
+    if (!task_graph) return;
+    for (size_t reader : buffer_readers[buffer]) {
+        if (reader != current_task) task_edges.push_back({reader, current_task});
+    }
+    buffer_readers[buffer].clear();
+}
+
+void CodeGen::release_if_dead(const std::string& value) {
+    if (consume(value)) {
+        release_buffer(buffer_of[value]);
+    }
+}
+
+// Returns a buffer to the arena through its owner. In a task graph a
+// temporary owner is local to the task that made it, so a buffer that
+// outlives its statement only through a view is left to the arena reset.
+void CodeGen::release_buffer(size_t buffer) {
+    kill_buffer(buffer);
+    const BufferOwner& owner = buffer_owner[buffer];
+    if (task_graph && owner.temporary && owner.task != current_task) return;
+    output << "    vec_release(arena, " << owner.name << ");\n";
+}
+
+// Length checks the type checker had to leave to run time; shapes are
+// unknown only downstream of slices with run-time bounds
+void CodeGen::check_lengths(const Instruction& inst, std::string& left, std::string& right) {
+    const Shape& ls = operand(inst, 0).shape;
+    const Shape& rs = operand(inst, 1).shape;
+    Type left_type = operand(inst, 0).type;
+    Type right_type = operand(inst, 1).type;
+    bool left_vector = left_type == Type::VEC || left_type == Type::SVEC;
+    bool right_vector = right_type == Type::VEC || right_type == Type::SVEC;
+    if ((ls.known && rs.known) || !right_vector || (!left_vector && left_type != Type::MAT)) {
+        return;
+    }
+
+    // Operands are read twice, so svec expressions are spilled first
+    if (!ls.known && left_type == Type::SVEC) left = spill(left_type, left);
+    if (!rs.known && right_type == Type::SVEC) right = spill(right_type, right);
+    std::string left_length = ls.known ? std::to_string(left_type == Type::MAT ? ls.cols : ls.rows)
+                                       : left + ".size";
+    std::string right_length = rs.known ? std::to_string(rs.rows) : right + ".size";
+    output << "    vec_check_length(" << left_length << ", " << right_length << ", '" << binary_operator(inst.op) << "');\n";
+}
+
+std::string CodeGen::spill(Type type, const std::string& code) {
+    std::string temp = new_temp();
+    output << "    " << cpp_type(type) << " " << temp << " = " << code << ";\n";
+    return temp;
+}
+
 std::string CodeGen::new_temp() {
     return "_t" + std::to_string(temp_counter++);
 }
\ No newline at end of file
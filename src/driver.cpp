@@ -0,0 +1,173 @@
+#include "driver.h"
+#include "build_cache.h"
+#include "lexer.h"
+#include "parser.h"
+#include "typechecker.h"
+#include "codegen.h"
+#include "passes.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/wait.h>
+#include <unistd.h>
+
+std::string resolve_path(const std::string& cwd, const std::string& path) {
+    if (cwd.empty() || path.empty() || path[0] == '/') {
+        return path;
+    }
+    return cwd + "/" + path;
+}
+
+bool read_source(const std::string& path, std::string& source, std::ostream& err) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        err << "Error: Could not open file " << path << std::endl;
+        return false;
+    }
+    source.assign(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    file.read(&source[0], static_cast<std::streamsize>(source.size()));
+    return true;
+}
+
+int run_command(const std::vector<std::string>& args, std::ostream* output) {
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    // Close-on-exec, so children forked by other daemon workers don't
+    // hold the write end open
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        if (output) *output << "Error: could not run " << args[0] << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Only async-signal-safe calls until exec: the daemon is multithreaded
+        int sink = output ? fds[1] : open("/dev/null", O_WRONLY);
+        dup2(sink, STDOUT_FILENO);
+        dup2(sink, STDERR_FILENO);
+        execvp(argv[0], argv.data());
+        const char message[] = "Error: could not run ";
+        ssize_t ignored = write(STDERR_FILENO, message, sizeof(message) - 1);
+        ignored = write(STDERR_FILENO, argv[0], std::strlen(argv[0]));
+        ignored = write(STDERR_FILENO, "\n", 1);
+        (void)ignored;
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        if (output) *output << "Error: could not run " << args[0] << ": " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (output) output->write(buf, n);
+    }
+    close(fds[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int compile(const CompilerOptions& given, const std::string& source, std::ostream& out,
+            std::ostream& err, const CompileEnvironment& env) {
+    CompilerOptions options = given;
+    options.output_file = resolve_path(env.cwd, options.output_file);
+    std::string output_file = resolve_path(env.cwd, "output.cpp");
+
+    if (options.print_pipeline) {
+        out << "=== Pipeline ===" << std::endl;
+        print_pipeline(out, options, output_file);
+        out << std::endl;
+    }
+
+    // With a daemon's cache, the backend is handed the precompiled runtime
+    // with -include; output.cpp still carries its own copy
+    std::string runtime_header;
+    Arena local_arena;
+    Arena& arena = env.arena ? *env.arena : local_arena;
+    arena.reset();
+
+    try {
+        out << "=== Lexing ===" << std::endl;
+        Lexer lexer(source);
+        std::vector<Token> tokens = lexer.tokenize();
+        out << "Generated " << tokens.size() << " tokens" << std::endl;
+
+        out << "\n=== Parsing ===" << std::endl;
+        Parser parser(std::move(tokens), arena);
+        Program* program = parser.parse();
+        out << "Parsed " << program->statements.size() << " statements" << std::endl;
+
+        out << "\n=== Type Checking ===" << std::endl;
+        TypeChecker checker(arena, err);
+        if (!checker.check(program)) {
+            err << "Type checking failed!" << std::endl;
+            return 1;
+        }
+        out << "Type checking passed" << std::endl;
+
+        out << "\n=== Optimisation (-O" << options.opt_level << ") ===" << std::endl;
+        IRProgram ir = lower_program(program);
+        out << "Lowered to " << ir.instructions.size() << " IR instructions" << std::endl;
+        PassManager passes(arena, enabled_passes(options));
+        passes.set_verify(options.verify_ir);
+        passes.set_dump(options.dump_ir ? &out : nullptr);
+        passes.run(ir);
+        for (const PassTiming& pass : passes.timings()) {
+            char line[96];
+            std::snprintf(line, sizeof(line), "  %-12s %6d changes %10.3f ms", pass.name.c_str(),
+                          pass.changes, pass.milliseconds);
+            out << line << std::endl;
+        }
+        if (options.verify_ir) {
+            out << "IR verified" << std::endl;
+        }
+
+        out << "\n=== Code Generation ===" << std::endl;
+        CodeGen codegen(options.codegen);
+        if (env.cache) {
+            std::string runtime;
+            codegen.generate_runtime(ir, runtime);
+            runtime_header = env.cache->runtime_header(runtime, options);
+        }
+        if (!codegen.generate(ir, output_file)) {
+            err << "Error: Could not write to file " << output_file << std::endl;
+            return 1;
+        }
+        out << "Generated C++ code to " << output_file << std::endl;
+    } catch (const std::exception& e) {
+        err << e.what() << std::endl;
+        return 1;
+    }
+
+    out << "\n=== Compiling with " << options.backend_cc << " ===" << std::endl;
+    std::vector<std::string> args = backend_args(options, output_file);
+    if (!runtime_header.empty()) {
+        args.push_back("-include");
+        args.push_back(runtime_header);
+    }
+    if (run_command(args, &err) != 0) {
+        err << "Compilation failed!" << std::endl;
+        return 1;
+    }
+    out << "Compilation successful! Run with: ./" << given.output_file << std::endl;
+    return 0;
+}
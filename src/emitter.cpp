@@ -0,0 +1,54 @@
+#include "emitter.h"
+
+Emitter::Emitter(size_t buffer_size)
+    : file(nullptr), target(nullptr), buffer(buffer_size), used(0), failed(false) {}
+
+Emitter::~Emitter() {
+    close();
+}
+
+bool Emitter::open(const std::string& filename) {
+    close();
+    file = std::fopen(filename.c_str(), "wb");
+    used = 0;
+    failed = file == nullptr;
+    return file != nullptr;
+}
+
+void Emitter::open_string(std::string& text) {
+    close();
+    target = &text;
+    used = 0;
+    failed = false;
+}
+
+bool Emitter::close() {
+    flush();
+    target = nullptr;
+    if (file && std::fclose(file) != 0) failed = true;
+    file = nullptr;
+    return !failed;
+}
+
+Emitter& Emitter::write(const char* data, size_t size) {
+    if (used + size > buffer.size()) {
+        flush();
+        // Anything larger than the buffer goes straight to the output
+        if (size > buffer.size()) {
+            if (target) target->append(data, size);
+            if (file && std::fwrite(data, 1, size, file) != size) failed = true;
+            return *this;
+        }
+    }
+    std::memcpy(buffer.data() + used, data, size);
+    used += size;
+    return *this;
+}
+
+void Emitter::flush() {
+    if (target) target->append(buffer.data(), used);
+    if (file && used > 0 && std::fwrite(buffer.data(), 1, used, file) != used) {
+        failed = true;
+    }
+    used = 0;
+}
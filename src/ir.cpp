@@ -0,0 +1,382 @@
+#include "ir.h"
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <unordered_map>
+
+std::vector<int> IRProgram::use_counts() const {
+    std::vector<int> uses(instructions.size(), 0);
+    for (const Instruction& inst : instructions) {
+        if (inst.removed) continue;
+        for (size_t operand : inst.operands) {
+            if (operand < uses.size()) uses[operand]++;
+        }
+    }
+    return uses;
+}
+
+// An operand that pointed at a removed instruction becomes SIZE_MAX, which
+// the verifier reports
+void IRProgram::compact() {
+    std::vector<size_t> new_id(instructions.size(), SIZE_MAX);
+    size_t kept = 0;
+    for (size_t i = 0; i < instructions.size(); i++) {
+        if (instructions[i].removed) continue;
+        new_id[i] = kept;
+        if (kept != i) instructions[kept] = std::move(instructions[i]);
+        for (size_t& operand : instructions[kept].operands) {
+            operand = operand < new_id.size() ? new_id[operand] : SIZE_MAX;
+        }
+        kept++;
+    }
+    instructions.resize(kept, Instruction(Opcode::CONST, Type::UNKNOWN, Shape(), 0));
+}
+
+static bool is_scalar(Type t) {
+    return t == Type::INT || t == Type::FLOAT;
+}
+
+Effect effect_of(const Instruction& inst) {
+    switch (inst.op) {
+    case Opcode::PRINT: return Effect::OUTPUT;
+    case Opcode::INPUT: return Effect::INPUT;
+    case Opcode::SLICE: return Effect::VIEW;
+    case Opcode::CONST:
+    case Opcode::LET:
+        return Effect::NONE;
+    default:
+        return is_scalar(inst.type) ? Effect::NONE : Effect::ALLOC;
+    }
+}
+
+const char* opcode_name(Opcode op) {
+    switch (op) {
+    case Opcode::CONST: return "const";
+    case Opcode::INPUT: return "input";
+    case Opcode::LET: return "let";
+    case Opcode::ADD: return "add";
+    case Opcode::SUB: return "sub";
+    case Opcode::MUL: return "mul";
+    case Opcode::DIV: return "div";
+    case Opcode::CALL: return "call";
+    case Opcode::SLICE: return "slice";
+    case Opcode::PRINT: return "print";
+    }
+    return "?";
+}
+
+char binary_operator(Opcode op) {
+    switch (op) {
+    case Opcode::ADD: return '+';
+    case Opcode::SUB: return '-';
+    case Opcode::MUL: return '*';
+    default: return '/';
+    }
+}
+
+static Opcode binary_opcode(char op) {
+    switch (op) {
+    case '+': return Opcode::ADD;
+    case '-': return Opcode::SUB;
+    case '*': return Opcode::MUL;
+    default: return Opcode::DIV;
+    }
+}
+
+// Post-order over the expression with a stack of operand ids, like the old
+// AST code generator; identifiers resolve to the value bound by let/input
+static size_t lower_expression(IRProgram& ir, const std::unordered_map<std::string, size_t>& scope,
+                               ASTNode* expr, size_t statement) {
+    std::vector<size_t> values;
+    visit_postorder(expr, [&](ASTNode*& node) {
+        if (node->node_type == NodeType::IDENTIFIER) {
+            values.push_back(scope.at(static_cast<Identifier*>(node)->name));
+            return;
+        }
+
+        Instruction inst(Opcode::CONST, node->type, node->shape, statement);
+        inst.node = node;
+        size_t argc = 0;
+        switch (node->node_type) {
+        case NodeType::BINARY_OP:
+            inst.op = binary_opcode(static_cast<BinaryOp*>(node)->op);
+            argc = 2;
+            break;
+        case NodeType::CALL:
+            inst.op = Opcode::CALL;
+            inst.name = static_cast<Call*>(node)->name;
+            argc = static_cast<Call*>(node)->args.size();
+            break;
+        case NodeType::SLICE:
+            inst.op = Opcode::SLICE;
+            argc = static_cast<Slice*>(node)->operand_count();
+            break;
+        default: // literals
+            break;
+        }
+        inst.operands.assign(values.end() - argc, values.end());
+        values.resize(values.size() - argc);
+        values.push_back(ir.instructions.size());
+        ir.instructions.push_back(std::move(inst));
+    });
+    return values.back();
+}
+
+IRProgram lower_program(Program* program) {
+    IRProgram ir;
+    std::unordered_map<std::string, size_t> scope;
+
+    for (size_t s = 0; s < program->statements.size(); s++) {
+        ASTNode* stmt = program->statements[s];
+        switch (stmt->node_type) {
+        case NodeType::VAR_DECL: {
+            VarDecl* decl = static_cast<VarDecl*>(stmt);
+            size_t value = lower_expression(ir, scope, decl->initializer, s);
+            Instruction let(Opcode::LET, decl->var_type, decl->initializer->shape, s);
+            let.name = decl->name;
+            let.node = decl;
+            let.operands.push_back(value);
+            scope[decl->name] = ir.instructions.size();
+            ir.instructions.push_back(std::move(let));
+            ir.statements.push_back({NodeType::VAR_DECL, decl->name, stmt->line});
+            break;
+        }
+        case NodeType::PRINT_STMT: {
+            PrintStmt* print = static_cast<PrintStmt*>(stmt);
+            size_t value = lower_expression(ir, scope, print->expr, s);
+            Instruction inst(Opcode::PRINT, Type::UNKNOWN, Shape(), s);
+            inst.node = print;
+            inst.operands.push_back(value);
+            ir.instructions.push_back(std::move(inst));
+            ir.statements.push_back({NodeType::PRINT_STMT, "", stmt->line});
+            break;
+        }
+        case NodeType::INPUT_DECL: {
+            InputDecl* input = static_cast<InputDecl*>(stmt);
+            Instruction inst(Opcode::INPUT, input->var_type, input->shape, s);
+            inst.name = input->name;
+            inst.node = input;
+            scope[input->name] = ir.instructions.size();
+            ir.instructions.push_back(std::move(inst));
+            ir.statements.push_back({NodeType::INPUT_DECL, input->name, stmt->line});
+            break;
+        }
+        case NodeType::FN_DECL: {
+            FnDecl* fn = static_cast<FnDecl*>(stmt);
+            ir.functions.push_back(fn);
+            ir.statements.push_back({NodeType::FN_DECL, fn->name, stmt->line});
+            break;
+        }
+        default:
+            ir.statements.push_back({stmt->node_type, "", stmt->line});
+            break;
+        }
+    }
+    return ir;
+}
+
+static NodeType literal_kind(Type type) {
+    switch (type) {
+    case Type::INT: return NodeType::LITERAL_INT;
+    case Type::FLOAT: return NodeType::LITERAL_FLOAT;
+    case Type::VEC: return NodeType::LITERAL_VEC;
+    case Type::MAT: return NodeType::LITERAL_MAT;
+    default: return NodeType::LITERAL_SVEC;
+    }
+}
+
+// Expected operand count, or -1 when it depends on the instruction
+static int arity(const Instruction& inst) {
+    switch (inst.op) {
+    case Opcode::CONST:
+    case Opcode::INPUT:
+        return 0;
+    case Opcode::CALL:
+        if (inst.node && inst.node->node_type == NodeType::CALL && static_cast<Call*>(inst.node)->fn) {
+            return static_cast<int>(static_cast<Call*>(inst.node)->fn->params.size());
+        }
+        return 1;
+    case Opcode::LET:
+    case Opcode::PRINT:
+        return 1;
+    case Opcode::SLICE:
+        return inst.node && inst.node->node_type == NodeType::SLICE
+            ? static_cast<int>(static_cast<Slice*>(inst.node)->operand_count())
+            : -1;
+    default:
+        return 2;
+    }
+}
+
+bool verify_ir(const IRProgram& program, std::string& error) {
+    const std::vector<Instruction>& insts = program.instructions;
+    for (size_t id = 0; id < insts.size(); id++) {
+        const Instruction& inst = insts[id];
+        auto fail = [&](const std::string& message) {
+            error = "%" + std::to_string(id) + " (" + opcode_name(inst.op) + "): " + message;
+            return false;
+        };
+
+        if (inst.removed) return fail("removed instruction left in the program");
+        if (inst.statement >= program.statements.size()) return fail("no source statement");
+        if (id > 0 && inst.statement < insts[id - 1].statement) return fail("out of statement order");
+        int expected = arity(inst);
+        if (expected < 0 || inst.operands.size() != static_cast<size_t>(expected)) {
+            return fail("wrong number of operands");
+        }
+        for (size_t operand : inst.operands) {
+            if (operand >= id) {
+                return fail("operand " + (operand == SIZE_MAX ? std::string("(removed)") : "%" + std::to_string(operand)) +
+                            " is not defined before its use");
+            }
+            const Instruction& def = insts[operand];
+            if (def.op == Opcode::PRINT) {
+                return fail("operand %" + std::to_string(operand) + " has no value");
+            }
+            bool shared = def.op == Opcode::LET || def.op == Opcode::INPUT ||
+                          (def.op == Opcode::CONST && is_scalar(def.type));
+            if (def.statement != inst.statement && !shared) {
+                return fail("operand %" + std::to_string(operand) +
+                            " comes from another statement but is not a let, input or scalar constant");
+            }
+            if (def.type == Type::UNKNOWN) {
+                return fail("operand %" + std::to_string(operand) + " has no type");
+            }
+        }
+
+        switch (inst.op) {
+        case Opcode::CONST:
+            if (!inst.node || inst.node->node_type != literal_kind(inst.type)) {
+                return fail("literal does not match type " + type_to_string(inst.type));
+            }
+            break;
+        case Opcode::INPUT:
+        case Opcode::LET:
+            if (inst.name.empty()) return fail("unnamed binding");
+            if (inst.op == Opcode::LET && insts[inst.operands[0]].type != inst.type) {
+                return fail("binds a " + type_to_string(insts[inst.operands[0]].type) + " value as " +
+                            type_to_string(inst.type));
+            }
+            break;
+        case Opcode::ADD:
+        case Opcode::SUB:
+        case Opcode::MUL:
+        case Opcode::DIV: {
+            const Instruction& a = insts[inst.operands[0]];
+            const Instruction& b = insts[inst.operands[1]];
+            if (is_scalar(a.type) && is_scalar(b.type)) {
+                Type result = a.type == Type::INT && b.type == Type::INT ? Type::INT : Type::FLOAT;
+                if (inst.type != result) return fail("scalar result should be " + type_to_string(result));
+            } else if (inst.type == Type::UNKNOWN || is_scalar(inst.type)) {
+                return fail("vector or matrix operands with a " + type_to_string(inst.type) + " result");
+            }
+            if (a.type == Type::VEC && b.type == Type::VEC) {
+                if (a.shape.known && b.shape.known && a.shape.rows != b.shape.rows) {
+                    return fail("operand lengths differ: " + shape_to_string(a.type, a.shape) + " and " +
+                                shape_to_string(b.type, b.shape));
+                }
+                const Shape& known = a.shape.known ? a.shape : b.shape;
+                if (inst.shape.known && known.known && inst.shape.rows != known.rows) {
+                    return fail("result length differs from the operands");
+                }
+            }
+            break;
+        }
+        case Opcode::CALL: {
+            if (inst.name.empty()) return fail("call without a function name");
+            if (inst.type == Type::UNKNOWN) return fail("call without a result type");
+            const Call* call = inst.node && inst.node->node_type == NodeType::CALL
+                ? static_cast<const Call*>(inst.node) : nullptr;
+            if (!call || !call->fn) break;
+            const FnDecl::Specialisation& spec = call->fn->specialisations[call->specialisation];
+            for (size_t i = 0; i < inst.operands.size(); i++) {
+                Type arg = insts[inst.operands[i]].type;
+                bool fits = spec.types[i] == Type::FLOAT ? arg == Type::INT || arg == Type::FLOAT
+                                                         : arg == spec.types[i];
+                if (!fits) return fail("argument " + std::to_string(i) + " does not fit the specialisation");
+            }
+            if ((inst.type == Type::VEC) != spec.elementwise) {
+                return fail("only an element-wise call has a vec result");
+            }
+            break;
+        }
+        case Opcode::SLICE:
+            if (insts[inst.operands[0]].type != Type::VEC || inst.type != Type::VEC) {
+                return fail("only vecs can be sliced");
+            }
+            for (size_t i = 1; i < inst.operands.size(); i++) {
+                if (insts[inst.operands[i]].type != Type::INT) return fail("slice bounds must be int");
+            }
+            break;
+        case Opcode::PRINT:
+            break;
+        }
+    }
+    return true;
+}
+
+static void dump_literal(std::ostream& out, const Instruction& inst) {
+    switch (inst.node->node_type) {
+    case NodeType::LITERAL_INT:
+        out << static_cast<LiteralInt*>(inst.node)->value;
+        break;
+    case NodeType::LITERAL_FLOAT:
+        out << static_cast<LiteralFloat*>(inst.node)->value;
+        break;
+    case NodeType::LITERAL_VEC: {
+        LiteralVec* vec = static_cast<LiteralVec*>(inst.node);
+        out << "[";
+        for (size_t i = 0; i < vec->size && i < 8; i++) {
+            out << (i ? ", " : "") << vec->values[i];
+        }
+        out << (vec->size > 8 ? ", ...]" : "]");
+        break;
+    }
+    case NodeType::LITERAL_SVEC:
+        out << "{" << static_cast<LiteralSVec*>(inst.node)->nnz << " non-zeros}";
+        break;
+    default:
+        out << "<data>";
+        break;
+    }
+}
+
+// One instruction per line, grouped by source statement:
+//   %3 = add vec[4] %1, %2    ; alloc
+void dump_ir(std::ostream& out, const IRProgram& program) {
+    static const char* const effects[] = {"", "alloc", "view", "input", "output"};
+    size_t statement = SIZE_MAX;
+    for (size_t id = 0; id < program.instructions.size(); id++) {
+        const Instruction& inst = program.instructions[id];
+        if (inst.statement != statement && inst.statement < program.statements.size()) {
+            statement = inst.statement;
+            const IRStatement& info = program.statements[statement];
+            const char* kind = info.kind == NodeType::VAR_DECL ? "let" :
+                               info.kind == NodeType::INPUT_DECL ? "input" : "print";
+            out << "; " << kind << (info.name.empty() ? "" : " " + info.name)
+                << " (line " << info.line << ")\n";
+        }
+
+        std::ostringstream line;
+        line << "  ";
+        if (inst.op != Opcode::PRINT) line << "%" << id << " = ";
+        line << opcode_name(inst.op);
+        if (!inst.name.empty()) line << " " << inst.name;
+        if (inst.type != Type::UNKNOWN) line << " " << shape_to_string(inst.type, inst.shape);
+        for (size_t i = 0; i < inst.operands.size(); i++) {
+            line << (i ? ", %" : " %") << inst.operands[i];
+        }
+        if (inst.op == Opcode::CONST) {
+            line << " ";
+            dump_literal(line, inst);
+        }
+
+        std::string text = line.str();
+        Effect effect = effect_of(inst);
+        if (effect != Effect::NONE) {
+            text.resize(std::max<size_t>(text.size() + 1, 36), ' ');
+            text += "; " + std::string(effects[static_cast<int>(effect)]);
+        }
+        out << text << "\n";
+    }
+}
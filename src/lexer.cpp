@@ -1,5 +1,6 @@
 #include "lexer.h"
 #include <cctype>
+#include <cstring>
 
 Lexer::Lexer(const std::string& source) 
     : source(source), pos(0), line(1), column(1) {}
@@ -19,6 +20,18 @@ std::vector<Token> Lexer::tokenize() {
         
         char c = current_char();
         
+        // Brackets after a type name or a value are shapes/slices, not data
+        bool after_name = !tokens.empty() &&
+            (tokens.back().type == TokenType::IDENTIFIER ||
+             tokens.back().type == TokenType::TYPE_VEC ||
+             tokens.back().type == TokenType::TYPE_MAT ||
+             tokens.back().type == TokenType::RPAREN ||
+             tokens.back().type == TokenType::RBRACKET ||
+             tokens.back().type == TokenType::VEC_LITERAL);
+        if (c == '[' && !after_name && try_read_vec_literal(tokens)) {
+            continue;
+        }
+        
         if (is_digit(c)) {
             tokens.push_back(read_number());
         } else if (is_alpha(c)) {
@@ -37,6 +50,9 @@ std::vector<Token> Lexer::tokenize() {
                 case ')': tokens.push_back(Token(TokenType::RPAREN, ")", line, col)); advance(); break;
                 case '[': tokens.push_back(Token(TokenType::LBRACKET, "[", line, col)); advance(); break;
                 case ']': tokens.push_back(Token(TokenType::RBRACKET, "]", line, col)); advance(); break;
+                case '{': tokens.push_back(Token(TokenType::LBRACE, "{", line, col)); advance(); break;
+                case '}': tokens.push_back(Token(TokenType::RBRACE, "}", line, col)); advance(); break;
+                case '|': tokens.push_back(Token(TokenType::PIPE, "|", line, col)); advance(); break;
                 default:
                     tokens.push_back(Token(TokenType::UNKNOWN, std::string(1, c), line, col));
                     advance();
@@ -119,14 +135,61 @@ Token Lexer::read_identifier() {
     TokenType type;
     if (id == "let") type = TokenType::LET;
     else if (id == "print") type = TokenType::PRINT;
+    else if (id == "input") type = TokenType::INPUT;
+    else if (id == "fn") type = TokenType::FN;
     else if (id == "int") type = TokenType::TYPE_INT;
     else if (id == "float") type = TokenType::TYPE_FLOAT;
     else if (id == "vec") type = TokenType::TYPE_VEC;
+    else if (id == "mat") type = TokenType::TYPE_MAT;
+    else if (id == "svec") type = TokenType::TYPE_SVEC;
     else type = TokenType::IDENTIFIER;
     
     return Token(type, id, line, col);
 }
 
+// Fast path for data-heavy sources: a [ ... ] whose body is only digits,
+// '.', ',' and whitespace is scanned in one pass and emitted as a single
+// VEC_LITERAL token instead of one token per number. Anything else (nested
+// brackets, slices, comments, signs) falls back to normal tokenization.
+bool Lexer::try_read_vec_literal(std::vector<Token>& tokens) {
+    static const struct CharTable {
+        bool allowed[256];
+        CharTable() : allowed() {
+            for (const char* c = "0123456789., \t\r\n"; *c; c++) {
+                allowed[static_cast<unsigned char>(*c)] = true;
+            }
+        }
+    } table;
+    
+    const char* begin = source.data() + pos + 1;
+    const char* end = source.data() + source.length();
+    const char* p = begin;
+    while (p < end && table.allowed[static_cast<unsigned char>(*p)]) {
+        p++;
+    }
+    if (p == end || *p != ']') {
+        return false;
+    }
+    
+    size_t body_length = p - begin;
+    tokens.push_back(Token(TokenType::VEC_LITERAL, std::string(begin, body_length), line, column));
+    
+    // Update line/column as if each character had been advanced over
+    const char* last_newline = nullptr;
+    for (const char* nl = begin; (nl = static_cast<const char*>(memchr(nl, '\n', p - nl))); nl++) {
+        line++;
+        last_newline = nl;
+    }
+    if (last_newline) {
+        column = static_cast<int>(p - last_newline);
+    } else {
+        column += static_cast<int>(body_length + 1);
+    }
+    column++;
+    pos += body_length + 2;
+    return true;
+}
+
 bool Lexer::is_digit(char c) {
     return isdigit(c);
 }
@@ -1,77 +1,40 @@
-#include "lexer.h"
-#include "parser.h"
-#include "typechecker.h"
-#include "codegen.h"
+#include "driver.h"
+#include "options.h"
+#include "server.h"
 #include <iostream>
-#include <fstream>
-#include <sstream>
-
-std::string read_file(const std::string& filename) {
-    std::ifstream file(filename);
-    if (!file) {
-        std::cerr << "Error: Could not open file " << filename << std::endl;
-        exit(1);
-    }
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    return buffer.str();
-}
-
-void write_file(const std::string& filename, const std::string& content) {
-    std::ofstream file(filename);
-    if (!file) {
-        std::cerr << "Error: Could not write to file " << filename << std::endl;
-        exit(1);
-    }
-    file << content;
-}
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <source.mml>" << std::endl;
+    CompilerOptions options;
+    std::string error;
+    if (!parse_options(argc, argv, options, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        std::cerr << usage(argv[0]);
         return 1;
     }
     
-    std::string source_file = argv[1];
-    std::string source = read_file(source_file);
-    
-    std::cout << "=== Lexing ===" << std::endl;
-    Lexer lexer(source);
-    std::vector<Token> tokens = lexer.tokenize();
-    std::cout << "Generated " << tokens.size() << " tokens" << std::endl;
-    
-    std::cout << "\n=== Parsing ===" << std::endl;
-    Arena arena;
-    Parser parser(tokens, arena);
-    Program* program = parser.parse();
-    std::cout << "Parsed " << program->statements.size() << " statements" << std::endl;
-    
-    std::cout << "\n=== Type Checking ===" << std::endl;
-    TypeChecker checker;
-    if (!checker.check(program)) {
-        std::cerr << "Type checking failed!" << std::endl;
+    std::string socket_path = options.socket_path;
+    if ((options.server || options.connect) && socket_path.empty() &&
+        !default_socket_path(socket_path, error)) {
+        std::cerr << "Error: " << error << std::endl;
         return 1;
     }
-    std::cout << "Type checking passed" << std::endl;
-    
-    std::cout << "\n=== Code Generation ===" << std::endl;
-    CodeGen codegen;
-    std::string cpp_code = codegen.generate(program);
-    
-    std::string output_file = "output.cpp";
-    write_file(output_file, cpp_code);
-    std::cout << "Generated C++ code to " << output_file << std::endl;
-    
-    std::cout << "\n=== Compiling with g++ ===" << std::endl;
-    std::string compile_cmd = "g++ -std=c++17 -o output " + output_file;
-    int result = system(compile_cmd.c_str());
+    if (options.server) {
+        return run_server(socket_path);
+    }
+    if (options.connect) {
+        std::vector<std::string> args;
+        for (int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg != "--connect" && arg.compare(0, 10, "--connect=") != 0) {
+                args.push_back(arg);
+            }
+        }
+        return run_client(socket_path, args);
+    }
     
-    if (result == 0) {
-        std::cout << "Compilation successful! Run with: ./output" << std::endl;
-    } else {
-        std::cerr << "Compilation failed!" << std::endl;
+    std::string source;
+    if (!read_source(options.source_file, source, std::cerr)) {
         return 1;
     }
-    
-    return 0;
-}
\ No newline at end of file
+    return compile(options, source, std::cout, std::cerr);
+}
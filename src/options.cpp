@@ -0,0 +1,175 @@
+#include "options.h"
+
+static bool take_value(const std::string& arg, const std::string& name, int argc, char** argv,
+                       int& i, std::string& value) {
+    if (arg == name) {
+        if (i + 1 >= argc) return false;
+        value = argv[++i];
+        return true;
+    }
+    if (arg.compare(0, name.size() + 1, name + "=") == 0) {
+        value = arg.substr(name.size() + 1);
+        return true;
+    }
+    return false;
+}
+
+bool parse_options(int argc, char** argv, CompilerOptions& options, std::string& error) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value;
+
+        if (arg == "--instrument") {
+            options.codegen.instrument = true;
+        } else if (arg == "--parallel") {
+            options.codegen.parallel = true;
+        } else if (arg == "--exact-math") {
+            options.codegen.exact_math = true;
+        } else if (arg == "--print-pipeline") {
+            options.print_pipeline = true;
+        } else if (arg == "--dump-ir") {
+            options.dump_ir = true;
+        } else if (arg == "--verify-ir") {
+            options.verify_ir = true;
+        } else if (arg == "--server" || arg.compare(0, 9, "--server=") == 0) {
+            options.server = true;
+            options.socket_path = arg.size() > 8 ? arg.substr(9) : "";
+        } else if (arg == "--connect" || arg.compare(0, 10, "--connect=") == 0) {
+            options.connect = true;
+            options.socket_path = arg.size() > 9 ? arg.substr(10) : "";
+        } else if (arg.size() == 3 && arg[0] == '-' && arg[1] == 'O' && arg[2] >= '0' && arg[2] <= '3') {
+            options.opt_level = arg[2] - '0';
+        } else if (take_value(arg, "--target-cpu", argc, argv, i, value)) {
+            options.target_cpu = value;
+        } else if (take_value(arg, "--backend-cc", argc, argv, i, value)) {
+            options.backend_cc = value;
+        } else if (arg[0] == '-') {
+            error = "unknown option '" + arg + "'";
+            return false;
+        } else if (options.source_file.empty()) {
+            options.source_file = arg;
+        } else {
+            error = "more than one source file given";
+            return false;
+        }
+    }
+
+    if (options.server && options.connect) {
+        error = "--server and --connect cannot be combined";
+        return false;
+    }
+    if (options.server) {
+        if (!options.source_file.empty()) {
+            error = "--server takes no source file";
+            return false;
+        }
+        return true;
+    }
+    if (options.source_file.empty()) {
+        error = "no source file given";
+        return false;
+    }
+    if (options.backend_cc.empty()) {
+        error = "--backend-cc needs a compiler name";
+        return false;
+    }
+    return true;
+}
+
+std::string usage(const std::string& program) {
+    return "Usage: " + program + " [options] <source.mml>\n"
+           "       " + program + " --server[=<socket>]\n"
+           "Options:\n"
+           "  -O0 | -O1 | -O2 | -O3     optimisation level (default -O2)\n"
+           "  --target-cpu=<cpu>        CPU to tune generated code for (-march), e.g. native\n"
+           "  --backend-cc=<compiler>   C++ compiler for the generated code (default g++)\n"
+           "  --print-pipeline          print the passes and backend command\n"
+           "  --dump-ir                 print the IR after lowering and after each pass that changes it\n"
+           "  --verify-ir               check the IR after lowering and after each pass\n"
+           "  --instrument              emit per-statement profiling code\n"
+           "  --parallel                run independent statements concurrently\n"
+           "  --exact-math              use libm for sqrt/exp/log/sin/cos instead of SIMD approximations\n"
+           "  --server[=<socket>]       run a compile daemon (default socket $MMLC_SOCKET,\n"
+           "                            $XDG_RUNTIME_DIR/mmlc.sock or /tmp/mmlc-<uid>/mmlc.sock)\n"
+           "  --connect[=<socket>]      compile through a running daemon\n";
+}
+
+std::vector<std::string> enabled_passes(const CompilerOptions& options) {
+    std::vector<std::string> passes;
+    if (options.opt_level >= 1) {
+        passes.push_back("const-fold");
+    }
+    if (options.opt_level >= 2) {
+        passes.push_back("const-prop");
+        passes.push_back("vec-fold");
+    }
+    if (options.opt_level >= 1) {
+        passes.push_back("dce");
+    }
+    return passes;
+}
+
+std::vector<std::string> backend_flags(const CompilerOptions& options) {
+    std::vector<std::string> flags;
+    flags.push_back("-std=c++17");
+    flags.push_back("-pthread");
+    flags.push_back("-O" + std::to_string(options.opt_level));
+    // Generated code never reads errno; without it sqrt loops vectorise
+    flags.push_back("-fno-math-errno");
+
+    if (options.opt_level >= 2) {
+        flags.push_back("-DNDEBUG");
+    }
+    if (options.opt_level >= 3) {
+        flags.push_back("-flto");
+    }
+    if (!options.target_cpu.empty()) {
+        flags.push_back("-march=" + options.target_cpu);
+    }
+    return flags;
+}
+
+std::vector<std::string> backend_args(const CompilerOptions& options, const std::string& cpp_file) {
+    std::vector<std::string> args = backend_flags(options);
+    args.insert(args.begin(), options.backend_cc);
+    args.push_back("-o");
+    args.push_back(options.output_file);
+    args.push_back(cpp_file);
+    return args;
+}
+
+// Single-quotes arg unless it only holds characters the shell takes literally
+static std::string shell_quote(const std::string& arg) {
+    static const char* const plain = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-+=.,:/@%";
+    if (!arg.empty() && arg.find_first_not_of(plain) == std::string::npos) {
+        return arg;
+    }
+    std::string quoted = "'";
+    for (char c : arg) {
+        quoted += c == '\'' ? std::string("'\\''") : std::string(1, c);
+    }
+    return quoted + "'";
+}
+
+std::string backend_command(const CompilerOptions& options, const std::string& cpp_file) {
+    std::string cmd;
+    for (const std::string& arg : backend_args(options, cpp_file)) {
+        cmd += (cmd.empty() ? "" : " ") + shell_quote(arg);
+    }
+    return cmd;
+}
+
+void print_pipeline(std::ostream& out, const CompilerOptions& options, const std::string& cpp_file) {
+    std::vector<std::string> passes = enabled_passes(options);
+
+    out << "Optimisation level: -O" << options.opt_level << std::endl;
+    out << "MiniMathLang passes:";
+    if (passes.empty()) {
+        out << " (none)";
+    }
+    for (size_t i = 0; i < passes.size(); i++) {
+        out << (i == 0 ? " " : ", ") << passes[i];
+    }
+    out << std::endl;
+    out << "Backend: " << backend_command(options, cpp_file) << std::endl;
+}
@@ -1,9 +1,32 @@
 #include "parser.h"
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
 #include <iostream>
 #include <stdexcept>
 
-Parser::Parser(const std::vector<Token>& tokens, Arena& arena)
-    : tokens(tokens), pos(0), arena(arena) {}
+// Converts a number token. A literal outside the range of T is a parse
+// error, like any other malformed input.
+template <typename T>
+static T convert_number(const Token& tok) {
+    T value{};
+    const char* begin = tok.value.data();
+    const char* end = begin + tok.value.size();
+    std::from_chars_result res = std::from_chars(begin, end, value);
+    if (res.ec == std::errc::result_out_of_range) {
+        throw std::runtime_error("Parse error at line " + std::to_string(tok.line) + ": number " +
+                                 tok.value + " is out of range");
+    }
+    if (res.ec != std::errc() || res.ptr != end) {
+        throw std::runtime_error("Parse error at line " + std::to_string(tok.line) + ": invalid number '" +
+                                 tok.value + "'");
+    }
+    return value;
+}
+
+Parser::Parser(std::vector<Token> tokens, Arena& arena)
+    : tokens(std::move(tokens)), pos(0), arena(arena) {}
 
 Program* Parser::parse() {
     Program* program = allocate<Program>();
@@ -15,12 +38,12 @@ Program* Parser::parse() {
     return program;
 }
 
-Token Parser::current() {
+const Token& Parser::current() {
     if (pos >= tokens.size()) return tokens.back();
     return tokens[pos];
 }
 
-Token Parser::peek() {
+const Token& Parser::peek() {
     if (pos + 1 >= tokens.size()) return tokens.back();
     return tokens[pos + 1];
 }
@@ -48,74 +71,169 @@ ASTNode* Parser::parse_statement() {
         return parse_var_decl();
     } else if (match(TokenType::PRINT)) {
         return parse_print_stmt();
+    } else if (match(TokenType::INPUT)) {
+        return parse_input_decl();
+    } else if (match(TokenType::FN)) {
+        return parse_fn_decl();
     } else {
         throw std::runtime_error("Parse error: expected statement");
     }
 }
 
 ASTNode* Parser::parse_var_decl() {
-    expect(TokenType::LET);
+    Token let = expect(TokenType::LET);
     Token name = expect(TokenType::IDENTIFIER);
     expect(TokenType::COLON);
     Type var_type = parse_type();
     expect(TokenType::ASSIGN);
     ASTNode* init = parse_expression();
     
-    return allocate<VarDecl>(name.value, var_type, init);
+    VarDecl* decl = allocate<VarDecl>(name.value, var_type, init);
+    decl->line = let.line;
+    return decl;
 }
 
 ASTNode* Parser::parse_print_stmt() {
-    expect(TokenType::PRINT);
+    Token print = expect(TokenType::PRINT);
     expect(TokenType::LPAREN);
     ASTNode* expr = parse_expression();
     expect(TokenType::RPAREN);
     
-    return allocate<PrintStmt>(expr);
+    PrintStmt* stmt = allocate<PrintStmt>(expr);
+    stmt->line = print.line;
+    return stmt;
 }
 
-ASTNode* Parser::parse_expression() {
-    return parse_term();
+// input x: float | input v: vec[4] | input m: mat[2, 3]
+ASTNode* Parser::parse_input_decl() {
+    Token input = expect(TokenType::INPUT);
+    Token name = expect(TokenType::IDENTIFIER);
+    expect(TokenType::COLON);
+    Type var_type = parse_type();
+    if (var_type == Type::SVEC) {
+        throw std::runtime_error("Parse error at line " + std::to_string(input.line) +
+                                 ": svec inputs are not supported; declare a vec input and use sparse()");
+    }
+    Shape shape = parse_shape(var_type);
+    
+    InputDecl* decl = allocate<InputDecl>(name.value, var_type, shape);
+    decl->line = input.line;
+    return decl;
 }
 
-ASTNode* Parser::parse_term() {
-    ASTNode* left = parse_factor();
-    
-    while (match(TokenType::PLUS) || match(TokenType::MINUS)) {
-        char op = current().value[0];
-        advance();
-        ASTNode* right = parse_factor();
-        left = allocate<BinaryOp>(op, left, right);
+// fn name(a: float, x: vec) = a * x; the type checker checks the types
+ASTNode* Parser::parse_fn_decl() {
+    Token fn = expect(TokenType::FN);
+    Token name = expect(TokenType::IDENTIFIER);
+    expect(TokenType::LPAREN);
+    std::vector<FnDecl::Param> params;
+    if (!match(TokenType::RPAREN)) {
+        do {
+            if (match(TokenType::COMMA)) advance();
+            Token param = expect(TokenType::IDENTIFIER);
+            expect(TokenType::COLON);
+            params.push_back({param.value, parse_type()});
+        } while (match(TokenType::COMMA));
     }
+    expect(TokenType::RPAREN);
+    expect(TokenType::ASSIGN);
+    ASTNode* body = parse_expression();
     
-    return left;
+    FnDecl* decl = allocate<FnDecl>(name.value, std::move(params), body);
+    decl->line = fn.line;
+    return decl;
+}
+
+static int precedence(char op) {
+    return (op == '*' || op == '/') ? 2 : 1;
 }
 
-ASTNode* Parser::parse_factor() {
-    ASTNode* left = parse_primary();
+// Operator-precedence parsing with explicit operand/operator stacks, so
+// long operator chains and deeply nested parentheses use heap memory instead
+// of recursion. '*' and '/' bind tighter than '+' and '-'; all are
+// left-associative. A '(' on the operator stack marks an open group.
+ASTNode* Parser::parse_expression() {
+    std::vector<ASTNode*> operands;
+    std::vector<char> operators;
+    size_t open_groups = 0;
     
-    while (match(TokenType::STAR) || match(TokenType::SLASH)) {
-        char op = current().value[0];
-        advance();
-        ASTNode* right = parse_primary();
-        left = allocate<BinaryOp>(op, left, right);
-    }
+    auto reduce = [&]() {
+        char op = operators.back();
+        operators.pop_back();
+        ASTNode* right = operands.back();
+        operands.pop_back();
+        ASTNode* left = operands.back();
+        operands.back() = allocate<BinaryOp>(op, left, right);
+    };
     
-    return left;
+    while (true) {
+        // Operand position: any number of '(' then a primary
+        while (match(TokenType::LPAREN)) {
+            operators.push_back('(');
+            open_groups++;
+            advance();
+        }
+        operands.push_back(parse_primary());
+        while (match(TokenType::LBRACKET)) {
+            operands.back() = parse_slice(operands.back());
+        }
+        
+        // Operator position: close groups (which may be sliced), then a
+        // binary operator or the end
+        while (match(TokenType::RPAREN) && open_groups > 0) {
+            while (operators.back() != '(') reduce();
+            operators.pop_back();
+            open_groups--;
+            advance();
+            while (match(TokenType::LBRACKET)) {
+                operands.back() = parse_slice(operands.back());
+            }
+        }
+        
+        if (match(TokenType::PLUS) || match(TokenType::MINUS) ||
+            match(TokenType::STAR) || match(TokenType::SLASH)) {
+            char op = current().value[0];
+            while (!operators.empty() && operators.back() != '(' &&
+                   precedence(operators.back()) >= precedence(op)) {
+                reduce();
+            }
+            operators.push_back(op);
+            advance();
+            continue;
+        }
+        
+        if (open_groups > 0) {
+            expect(TokenType::RPAREN); // reports the unbalanced '('
+        }
+        while (!operators.empty()) reduce();
+        return operands.back();
+    }
 }
 
 ASTNode* Parser::parse_primary() {
     if (match(TokenType::INT_LITERAL)) {
-        int value = std::stoi(current().value);
+        int value = convert_number<int>(current());
         advance();
         return allocate<LiteralInt>(value);
     }
     
     if (match(TokenType::FLOAT_LITERAL)) {
-        float value = std::stof(current().value);
+        float value = convert_number<float>(current());
         advance();
         return allocate<LiteralFloat>(value);
     }
     
+    if (match(TokenType::VEC_LITERAL)) {
+        ASTNode* vec = parse_vec_literal(current());
+        advance();
+        return vec;
+    }
+    
+    if (match(TokenType::LBRACKET) &&
+        (peek().type == TokenType::LBRACKET || peek().type == TokenType::VEC_LITERAL)) {
+        return parse_mat_literal();
+    }
+    
     if (match(TokenType::LBRACKET)) {
         advance();
         std::vector<float> values;
@@ -123,11 +241,9 @@ ASTNode* Parser::parse_primary() {
         if (!match(TokenType::RBRACKET)) {
             do {
                 if (match(TokenType::COMMA)) advance();
-                Token tok = current();
-                if (tok.type == TokenType::FLOAT_LITERAL) {
-                    values.push_back(std::stof(tok.value));
-                } else if (tok.type == TokenType::INT_LITERAL) {
-                    values.push_back(static_cast<float>(std::stoi(tok.value)));
+                const Token& tok = current();
+                if (tok.type == TokenType::FLOAT_LITERAL || tok.type == TokenType::INT_LITERAL) {
+                    values.push_back(convert_number<float>(tok));
                 } else {
                     throw std::runtime_error("Expected number in vector literal");
                 }
@@ -136,23 +252,196 @@ ASTNode* Parser::parse_primary() {
         }
         
         expect(TokenType::RBRACKET);
-        return allocate<LiteralVec>(values);
+        float* data = allocate_floats(values.size());
+        std::copy(values.begin(), values.end(), data);
+        return allocate<LiteralVec>(data, values.size());
+    }
+    
+    if (match(TokenType::LBRACE)) {
+        return parse_svec_literal();
     }
     
     if (match(TokenType::IDENTIFIER)) {
-        std::string name = current().value;
+        Token name = current();
         advance();
-        return allocate<Identifier>(name);
+        if (match(TokenType::LPAREN)) {
+            return parse_call(name);
+        }
+        return allocate<Identifier>(name.value);
+    }
+    
+    throw std::runtime_error("Parse error: unexpected token '" + current().value + "'");
+}
+
+// Single pass over the body of a VEC_LITERAL token: the element count is
+// bounded by the number of commas, so the arena buffer is sized up front and
+// each number is converted in place with std::from_chars (no allocation, no
+// locale, no exceptions per element).
+ASTNode* Parser::parse_vec_literal(const Token& body) {
+    const char* p = body.value.data();
+    const char* end = p + body.value.size();
+    
+    auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+    auto is_digit = [](char c) { return c >= '0' && c <= '9'; };
+    auto fail = [&body]() -> ASTNode* {
+        throw std::runtime_error("Parse error at line " + std::to_string(body.line) +
+                                 ": expected number in vector literal");
+    };
+    
+    while (p < end && is_space(*p)) p++;
+    if (p == end) {
+        return allocate<LiteralVec>(allocate_floats(0), 0);
+    }
+    
+    size_t capacity = std::count(p, end, ',') + 1;
+    float* data = allocate_floats(capacity);
+    size_t count = 0;
+    
+    while (true) {
+        // The lexer only lets digits, '.', ',' and whitespace through, so a
+        // leading digit is all from_chars needs to match Lexer::read_number
+        if (p == end || !is_digit(*p)) return fail();
+        std::from_chars_result res = std::from_chars(p, end, data[count]);
+        if (res.ec != std::errc()) return fail();
+        p = res.ptr;
+        count++;
+        
+        while (p < end && is_space(*p)) p++;
+        if (p == end) break;
+        if (*p != ',') return fail();
+        p++;
+        while (p < end && is_space(*p)) p++;
+    }
+    
+    return allocate<LiteralVec>(data, count);
+}
+
+// [[a, b], [c, d]]: each row is an ordinary vector literal (usually a
+// single VEC_LITERAL token); rows are copied into one row-major buffer.
+ASTNode* Parser::parse_mat_literal() {
+    int line = current().line;
+    expect(TokenType::LBRACKET);
+    
+    std::vector<LiteralVec*> rows;
+    do {
+        if (match(TokenType::COMMA)) advance();
+        if (!match(TokenType::LBRACKET) && !match(TokenType::VEC_LITERAL)) {
+            throw std::runtime_error("Parse error at line " + std::to_string(current().line) +
+                                     ": expected row in matrix literal");
+        }
+        ASTNode* row = parse_primary();
+        if (row->node_type != NodeType::LITERAL_VEC) {
+            throw std::runtime_error("Parse error at line " + std::to_string(line) +
+                                     ": matrix rows must be vector literals");
+        }
+        rows.push_back(static_cast<LiteralVec*>(row));
+    } while (match(TokenType::COMMA));
+    expect(TokenType::RBRACKET);
+    
+    size_t cols = rows[0]->size;
+    for (LiteralVec* row : rows) {
+        if (row->size != cols) {
+            throw std::runtime_error("Parse error at line " + std::to_string(line) +
+                                     ": matrix literal rows must have the same length");
+        }
+    }
+    
+    float* data = allocate_floats(rows.size() * cols);
+    for (size_t i = 0; i < rows.size(); i++) {
+        std::copy(rows[i]->values, rows[i]->values + cols, data + i * cols);
+    }
+    return allocate<LiteralMat>(data, rows.size(), cols);
+}
+
+// {size | index: value, ...}: entries may come in any order and are sorted
+// by index; an index may appear once and must be below size
+ASTNode* Parser::parse_svec_literal() {
+    int line = current().line;
+    expect(TokenType::LBRACE);
+    size_t size = convert_number<size_t>(expect(TokenType::INT_LITERAL));
+    expect(TokenType::PIPE);
+    
+    std::vector<std::pair<size_t, float>> entries;
+    if (!match(TokenType::RBRACE)) {
+        do {
+            if (match(TokenType::COMMA)) advance();
+            size_t index = convert_number<size_t>(expect(TokenType::INT_LITERAL));
+            expect(TokenType::COLON);
+            const Token& tok = current();
+            if (tok.type != TokenType::FLOAT_LITERAL && tok.type != TokenType::INT_LITERAL) {
+                throw std::runtime_error("Parse error at line " + std::to_string(tok.line) +
+                                         ": expected number in sparse vector literal");
+            }
+            entries.push_back({index, convert_number<float>(tok)});
+            advance();
+        } while (match(TokenType::COMMA));
     }
+    expect(TokenType::RBRACE);
     
-    if (match(TokenType::LPAREN)) {
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const std::pair<size_t, float>& a, const std::pair<size_t, float>& b) {
+                         return a.first < b.first;
+                     });
+    uint32_t* indices = static_cast<uint32_t*>(arena.allocate(entries.size() * sizeof(uint32_t)));
+    float* values = allocate_floats(entries.size());
+    for (size_t k = 0; k < entries.size(); k++) {
+        if (entries[k].first >= size || entries[k].first > UINT32_MAX) {
+            throw std::runtime_error("Parse error at line " + std::to_string(line) +
+                                     ": sparse index " + std::to_string(entries[k].first) +
+                                     " out of range for length " + std::to_string(size));
+        }
+        if (k > 0 && entries[k].first == entries[k - 1].first) {
+            throw std::runtime_error("Parse error at line " + std::to_string(line) +
+                                     ": sparse index " + std::to_string(entries[k].first) +
+                                     " given twice");
+        }
+        indices[k] = static_cast<uint32_t>(entries[k].first);
+        values[k] = entries[k].second;
+    }
+    return allocate<LiteralSVec>(indices, values, entries.size(), size);
+}
+
+// name(arg, ...): the type checker resolves name to a builtin
+ASTNode* Parser::parse_call(const Token& name) {
+    expect(TokenType::LPAREN);
+    std::vector<ASTNode*> args;
+    if (!match(TokenType::RPAREN)) {
+        args.push_back(parse_expression());
+        while (match(TokenType::COMMA)) {
+            advance();
+            args.push_back(parse_expression());
+        }
+    }
+    expect(TokenType::RPAREN);
+    
+    Call* call = allocate<Call>(name.value, std::move(args));
+    call->line = name.line;
+    return call;
+}
+
+// vec[start:stop] or vec[start:stop:step]; any bound may be left out
+ASTNode* Parser::parse_slice(ASTNode* vec) {
+    Token open = expect(TokenType::LBRACKET);
+    ASTNode* bounds[3] = {nullptr, nullptr, nullptr};
+    
+    if (!match(TokenType::COLON)) {
+        bounds[0] = parse_expression();
+    }
+    expect(TokenType::COLON);
+    if (!match(TokenType::COLON) && !match(TokenType::RBRACKET)) {
+        bounds[1] = parse_expression();
+    }
+    if (match(TokenType::COLON)) {
         advance();
-        ASTNode* expr = parse_expression();
-        expect(TokenType::RPAREN);
-        return expr;
+        if (!match(TokenType::RBRACKET)) {
+            bounds[2] = parse_expression();
+        }
     }
+    expect(TokenType::RBRACKET);
     
-    throw std::runtime_error("Parse error: unexpected token '" + current().value + "'");
+    Slice* slice = allocate<Slice>(vec, bounds[0], bounds[1], bounds[2]);
+    slice->line = open.line;
+    return slice;
 }
 
 Type Parser::parse_type() {
@@ -165,25 +454,80 @@ Type Parser::parse_type() {
     } else if (match(TokenType::TYPE_VEC)) {
         advance();
         return Type::VEC;
+    } else if (match(TokenType::TYPE_MAT)) {
+        advance();
+        return Type::MAT;
+    } else if (match(TokenType::TYPE_SVEC)) {
+        advance();
+        return Type::SVEC;
     } else {
         throw std::runtime_error("Parse error: expected type");
     }
 }
 
+Shape Parser::parse_shape(Type type) {
+    if (type != Type::VEC && type != Type::MAT) {
+        return Shape();
+    }
+    if (!match(TokenType::LBRACKET)) {
+        throw std::runtime_error("Parse error at line " + std::to_string(current().line) +
+                                 ": " + type_to_string(type) + " input needs a size, e.g. " +
+                                 (type == Type::VEC ? "vec[4]" : "mat[2, 3]"));
+    }
+    advance();
+    size_t rows = parse_dimension();
+    size_t cols = 1;
+    if (type == Type::MAT) {
+        expect(TokenType::COMMA);
+        cols = parse_dimension();
+    }
+    expect(TokenType::RBRACKET);
+    return Shape(rows, cols);
+}
+
+size_t Parser::parse_dimension() {
+    Token tok = expect(TokenType::INT_LITERAL);
+    size_t value = convert_number<size_t>(tok);
+    if (value == 0) {
+        throw std::runtime_error("Parse error at line " + std::to_string(tok.line) +
+                                 ": dimension must be positive");
+    }
+    return value;
+}
+
 // Arena allocator implementation
 Arena::Arena(size_t block_size) 
-    : block_size(block_size), current_block(nullptr), offset(0) {}
+    : block_size(block_size), block_index(0), current_block(nullptr), offset(0) {}
 
 Arena::~Arena() {
+    destroy_objects();
     for (char* block : blocks) {
         delete[] block;
     }
+    for (char* block : large_blocks) {
+        delete[] block;
+    }
 }
 
 void* Arena::allocate(size_t size) {
+    const size_t align = alignof(std::max_align_t);
+    size = (size + align - 1) & ~(align - 1);
+    
+    if (size > block_size) {
+        char* block = new char[size];
+        large_blocks.push_back(block);
+        return block;
+    }
+    
     if (!current_block || offset + size > block_size) {
-        current_block = new char[block_size];
-        blocks.push_back(current_block);
+        // Reuse blocks kept by reset() before asking for a new one
+        if (current_block && block_index + 1 < blocks.size()) {
+            current_block = blocks[++block_index];
+        } else {
+            current_block = new char[block_size];
+            blocks.push_back(current_block);
+            block_index = blocks.size() - 1;
+        }
         offset = 0;
     }
     
@@ -193,17 +537,40 @@ void* Arena::allocate(size_t size) {
 }
 
 void Arena::reset() {
+    destroy_objects();
+    for (char* block : large_blocks) {
+        delete[] block;
+    }
+    large_blocks.clear();
     offset = 0;
+    block_index = 0;
     if (!blocks.empty()) {
         current_block = blocks[0];
     }
 }
 
+void Arena::destroy_objects() {
+    for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+        it->second(it->first);
+    }
+    destructors.clear();
+}
+
 std::string type_to_string(Type t) {
     switch (t) {
         case Type::INT: return "int";
         case Type::FLOAT: return "float";
         case Type::VEC: return "vec";
+        case Type::MAT: return "mat";
+        case Type::SVEC: return "svec";
         default: return "unknown";
     }
+}
+
+std::string shape_to_string(Type t, const Shape& s) {
+    if (!s.known) return type_to_string(t);
+    if (t == Type::MAT) {
+        return "mat[" + std::to_string(s.rows) + "x" + std::to_string(s.cols) + "]";
+    }
+    return type_to_string(t) + "[" + std::to_string(s.rows) + "]";
 }
\ No newline at end of file
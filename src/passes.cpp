@@ -0,0 +1,226 @@
+#include "passes.h"
+#include <chrono>
+#include <climits>
+#include <stdexcept>
+
+static bool is_binary(const Instruction& inst) {
+    return inst.op == Opcode::ADD || inst.op == Opcode::SUB || inst.op == Opcode::MUL || inst.op == Opcode::DIV;
+}
+
+// The int or float literal value id stands for, looking through lets
+static const Instruction* scalar_constant(const IRProgram& program, size_t id) {
+    const Instruction* inst = &program.instructions[id];
+    while (inst->op == Opcode::LET) {
+        inst = &program.instructions[inst->operands[0]];
+    }
+    bool scalar = inst->type == Type::INT || inst->type == Type::FLOAT;
+    return inst->op == Opcode::CONST && scalar ? inst : nullptr;
+}
+
+static const Instruction* vec_constant(const IRProgram& program, size_t id) {
+    const Instruction* inst = &program.instructions[id];
+    return inst->op == Opcode::CONST && inst->type == Type::VEC ? inst : nullptr;
+}
+
+static float scalar_value(const Instruction* constant) {
+    if (constant->type == Type::INT) {
+        return static_cast<float>(static_cast<LiteralInt*>(constant->node)->value);
+    }
+    return static_cast<LiteralFloat*>(constant->node)->value;
+}
+
+// The instruction becomes a constant, keeping its id, type and statement
+static void make_constant(Instruction& inst, ASTNode* literal) {
+    literal->type = inst.type;
+    literal->shape = inst.shape;
+    inst.op = Opcode::CONST;
+    inst.operands.clear();
+    inst.name.clear();
+    inst.node = literal;
+}
+
+// const-fold: int/float arithmetic on constants, with the same semantics as
+// the generated C++ expression: int op int stays int (skipped on overflow or
+// division by zero), anything else is float
+static int fold_constants(IRProgram& program, Arena& arena) {
+    int folded = 0;
+    for (Instruction& inst : program.instructions) {
+        if (!is_binary(inst)) continue;
+        const Instruction* left = scalar_constant(program, inst.operands[0]);
+        const Instruction* right = scalar_constant(program, inst.operands[1]);
+        if (!left || !right) continue;
+
+        if (inst.type == Type::INT) {
+            long long a = static_cast<LiteralInt*>(left->node)->value;
+            long long b = static_cast<LiteralInt*>(right->node)->value;
+            long long r;
+            switch (inst.op) {
+            case Opcode::ADD: r = a + b; break;
+            case Opcode::SUB: r = a - b; break;
+            case Opcode::MUL: r = a * b; break;
+            default:
+                if (b == 0) continue;
+                r = a / b;
+                break;
+            }
+            if (r < INT_MIN || r > INT_MAX) continue;
+            make_constant(inst, arena.create<LiteralInt>(static_cast<int>(r)));
+        } else {
+            float a = scalar_value(left);
+            float b = scalar_value(right);
+            float r;
+            switch (inst.op) {
+            case Opcode::ADD: r = a + b; break;
+            case Opcode::SUB: r = a - b; break;
+            case Opcode::MUL: r = a * b; break;
+            default: r = a / b; break;
+            }
+            make_constant(inst, arena.create<LiteralFloat>(r));
+        }
+        folded++;
+    }
+    return folded;
+}
+
+// const-prop: reads of a let bound to a scalar constant read the constant.
+// One forward sweep, since a let is always defined before its uses.
+static int propagate_constants(IRProgram& program, Arena&) {
+    std::vector<size_t> target(program.instructions.size());
+    int redirected = 0;
+    for (size_t id = 0; id < program.instructions.size(); id++) {
+        Instruction& inst = program.instructions[id];
+        target[id] = id;
+        for (size_t& operand : inst.operands) {
+            if (target[operand] != operand) {
+                operand = target[operand];
+                redirected++;
+            }
+        }
+        if (inst.op == Opcode::LET && scalar_constant(program, inst.operands[0])) {
+            target[id] = inst.operands[0];
+        }
+    }
+    return redirected;
+}
+
+// vec-fold: element-wise arithmetic on vec constants
+static int fold_vectors(IRProgram& program, Arena& arena) {
+    int folded = 0;
+    for (Instruction& inst : program.instructions) {
+        if (!is_binary(inst) || inst.type != Type::VEC) continue;
+        const Instruction* left = vec_constant(program, inst.operands[0]);
+        const Instruction* right = vec_constant(program, inst.operands[1]);
+
+        if (left && right) {
+            LiteralVec* a = static_cast<LiteralVec*>(left->node);
+            LiteralVec* b = static_cast<LiteralVec*>(right->node);
+            if (a->size != b->size) continue;
+
+            float* r = static_cast<float*>(arena.allocate(a->size * sizeof(float)));
+            for (size_t i = 0; i < a->size; i++) {
+                switch (inst.op) {
+                case Opcode::ADD: r[i] = a->values[i] + b->values[i]; break;
+                case Opcode::SUB: r[i] = a->values[i] - b->values[i]; break;
+                case Opcode::MUL: r[i] = a->values[i] * b->values[i]; break;
+                default: r[i] = a->values[i] / b->values[i]; break;
+                }
+            }
+            make_constant(inst, arena.create<LiteralVec>(r, a->size));
+            folded++;
+            continue;
+        }
+
+        // Only + and * have a scalar-vector form in the runtime
+        if (inst.op != Opcode::ADD && inst.op != Opcode::MUL) continue;
+        const Instruction* vec = left ? left : right;
+        const Instruction* scalar = scalar_constant(program, inst.operands[left ? 1 : 0]);
+        if (!vec || !scalar) continue;
+
+        LiteralVec* v = static_cast<LiteralVec*>(vec->node);
+        float s = scalar_value(scalar);
+        float* r = static_cast<float*>(arena.allocate(v->size * sizeof(float)));
+        for (size_t i = 0; i < v->size; i++) {
+            r[i] = inst.op == Opcode::ADD ? v->values[i] + s : v->values[i] * s;
+        }
+        make_constant(inst, arena.create<LiteralVec>(r, v->size));
+        folded++;
+    }
+    return folded;
+}
+
+// dce: drops values nothing reads. Lets, inputs and prints stay, and so do
+// slices, whose run-time bounds checks can stop the program. One backward
+// sweep removes whole dead chains.
+static int eliminate_dead_code(IRProgram& program, Arena&) {
+    std::vector<int> uses = program.use_counts();
+    int removed = 0;
+    for (size_t id = program.instructions.size(); id-- > 0;) {
+        Instruction& inst = program.instructions[id];
+        Effect effect = effect_of(inst);
+        bool pure = effect == Effect::NONE || effect == Effect::ALLOC;
+        if (uses[id] > 0 || !pure || inst.op == Opcode::LET) continue;
+
+        inst.removed = true;
+        removed++;
+        for (size_t operand : inst.operands) {
+            uses[operand]--;
+        }
+    }
+    return removed;
+}
+
+static const struct {
+    const char* name;
+    IRPass run;
+} registry[] = {
+    {"const-fold", fold_constants},
+    {"const-prop", propagate_constants},
+    {"vec-fold", fold_vectors},
+    {"dce", eliminate_dead_code},
+};
+
+PassManager::PassManager(Arena& arena, const std::vector<std::string>& passes)
+    : arena(arena), verify(false), dump(nullptr) {
+    for (const std::string& name : passes) {
+        IRPass run = nullptr;
+        for (const auto& entry : registry) {
+            if (name == entry.name) run = entry.run;
+        }
+        if (!run) {
+            throw std::runtime_error("Unknown pass '" + name + "'");
+        }
+        pipeline.push_back({name, run});
+    }
+}
+
+void PassManager::check(const IRProgram& program, const std::string& stage) {
+    std::string error;
+    if (verify && !verify_ir(program, error)) {
+        throw std::runtime_error("IR verification failed after " + stage + ": " + error);
+    }
+}
+
+void PassManager::run(IRProgram& program) {
+    results.clear();
+    check(program, "lowering");
+    if (dump) {
+        *dump << "; IR after lowering\n";
+        dump_ir(*dump, program);
+    }
+
+    for (const std::pair<std::string, IRPass>& pass : pipeline) {
+        auto start = std::chrono::steady_clock::now();
+        int changes = pass.second(program, arena);
+        if (changes > 0) {
+            program.compact();
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        results.push_back({pass.first, changes, elapsed.count()});
+
+        check(program, pass.first);
+        if (dump && changes > 0) {
+            *dump << "; IR after " << pass.first << "\n";
+            dump_ir(*dump, program);
+        }
+    }
+}
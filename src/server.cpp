@@ -0,0 +1,402 @@
+#include "server.h"
+#include "build_cache.h"
+#include "driver.h"
+#include "options.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Wire format, both directions: length-prefixed strings (uint32 length in
+// native byte order, then the bytes). A request is the number of strings
+// that follow, in decimal, then the client's working directory and its
+// arguments; the reply is the compile's stdout, its stderr and the exit
+// status in decimal.
+
+// A request is a working directory and a command line, so these bounds
+// are generous; they keep a malformed or hostile client from making the
+// daemon allocate without limit
+static const size_t MAX_REQUEST_STRINGS = 4096;
+static const size_t MAX_REQUEST_BYTES = 1 << 20;
+
+static bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool read_all(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool send_string(int fd, const std::string& s) {
+    uint32_t size = static_cast<uint32_t>(s.size());
+    return write_all(fd, reinterpret_cast<const char*>(&size), sizeof(size)) &&
+           write_all(fd, s.data(), s.size());
+}
+
+// Reads a string of at most limit bytes; a longer one sets error and is
+// not read
+static bool recv_string(int fd, std::string& s, size_t limit, std::string& error) {
+    uint32_t size;
+    if (!read_all(fd, reinterpret_cast<char*>(&size), sizeof(size))) return false;
+    if (size > limit) {
+        error = "request larger than " + std::to_string(MAX_REQUEST_BYTES) + " bytes";
+        return false;
+    }
+    s.resize(size);
+    return read_all(fd, &s[0], size);
+}
+
+static bool recv_string(int fd, std::string& s) {
+    std::string error;
+    return recv_string(fd, s, UINT32_MAX, error);
+}
+
+// Reads a request within the limits above. False when the client hung up
+// or, with error set, sent a request the daemon will not serve.
+static bool recv_request(int fd, std::vector<std::string>& request, std::string& error) {
+    size_t budget = MAX_REQUEST_BYTES;
+    std::string count_text;
+    if (!recv_string(fd, count_text, budget, error)) return false;
+    budget -= count_text.size();
+
+    char* end;
+    unsigned long count = std::strtoul(count_text.c_str(), &end, 10);
+    if (count_text.empty() || *end != '\0' || count == 0 || count > MAX_REQUEST_STRINGS) {
+        error = "malformed request: expected 1 to " + std::to_string(MAX_REQUEST_STRINGS) + " strings";
+        return false;
+    }
+    request.resize(count);
+    for (std::string& s : request) {
+        if (!recv_string(fd, s, budget, error)) return false;
+        budget -= s.size();
+    }
+    return true;
+}
+
+static bool socket_address(const std::string& path, sockaddr_un& addr, std::string& error) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        error = "socket path too long: " + path;
+        return false;
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Owner of the process on the other end of a connected socket
+static bool peer_uid(int fd, uid_t& uid) {
+#ifdef SO_PEERCRED
+    ucred cred;
+    socklen_t size = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0) return false;
+    uid = cred.uid;
+    return true;
+#else
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0;
+#endif
+}
+
+static bool same_user(int fd) {
+    uid_t uid;
+    return peer_uid(fd, uid) && uid == getuid();
+}
+
+static int connect_socket(const std::string& path, std::string& error) {
+    sockaddr_un addr;
+    if (!socket_address(path, addr, error)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        error = "no mmlc daemon is listening on " + path + " (start one with mmlc --server)";
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Creates dir for this user only, or checks that an existing one is a real
+// directory nobody else can write to, so another user cannot plant a socket
+static bool private_directory(const std::string& dir, std::string& error) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        error = "could not create " + dir + ": " + std::strerror(errno);
+        return false;
+    }
+    struct stat info;
+    if (lstat(dir.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != getuid() ||
+        (info.st_mode & 077) != 0) {
+        error = dir + " must be a directory owned by you with mode 0700";
+        return false;
+    }
+    return true;
+}
+
+bool default_socket_path(std::string& path, std::string& error) {
+    const char* env = std::getenv("MMLC_SOCKET");
+    if (env && *env) {
+        path = env;
+        return true;
+    }
+    const char* runtime_dir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        path = std::string(runtime_dir) + "/mmlc.sock";
+        return true;
+    }
+    std::string dir = "/tmp/mmlc-" + std::to_string(getuid());
+    path = dir + "/mmlc.sock";
+    return private_directory(dir, error);
+}
+
+// One request: the same steps as the command line, except that a repeat of
+// an earlier successful compile is copied from the cache
+static int serve(const std::vector<std::string>& request, Arena& arena, BuildCache& cache,
+                 std::ostream& out, std::ostream& err) {
+    std::vector<char*> argv;
+    static char program_name[] = "mmlc";
+    argv.push_back(program_name);
+    for (size_t i = 1; i < request.size(); i++) {
+        argv.push_back(const_cast<char*>(request[i].c_str()));
+    }
+
+    CompilerOptions options;
+    std::string error;
+    if (!parse_options(static_cast<int>(argv.size()), argv.data(), options, error)) {
+        err << "Error: " << error << std::endl;
+        err << usage("mmlc");
+        return 1;
+    }
+    if (options.server || options.connect) {
+        err << "Error: --server and --connect are not accepted by the daemon" << std::endl;
+        return 1;
+    }
+
+    CompileEnvironment env;
+    env.cwd = request[0];
+    env.arena = &arena;
+    env.cache = &cache;
+    std::string source;
+    if (!read_source(resolve_path(env.cwd, options.source_file), source, err)) {
+        return 1;
+    }
+
+    std::string key = BuildCache::result_key(options, source);
+    std::string cpp_file = resolve_path(env.cwd, "output.cpp");
+    std::string binary = resolve_path(env.cwd, options.output_file);
+    if (cache.restore(key, cpp_file, binary)) {
+        if (options.print_pipeline) {
+            CompilerOptions resolved = options;
+            resolved.output_file = binary;
+            out << "=== Pipeline ===" << std::endl;
+            print_pipeline(out, resolved, cpp_file);
+            out << std::endl;
+        }
+        out << "=== Build cache ===" << std::endl;
+        out << "Reused the output of an identical earlier compile" << std::endl;
+        out << "Compilation successful! Run with: ./" << options.output_file << std::endl;
+        return 0;
+    }
+
+    int status = compile(options, source, out, err, env);
+    if (status == 0) {
+        cache.store(key, cpp_file, binary);
+    }
+    return status;
+}
+
+namespace {
+
+// Accepted connections waiting for a worker
+struct ConnectionQueue {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<int> fds;
+    bool closed = false;
+};
+
+volatile std::sig_atomic_t stop_requested = 0;
+
+void request_stop(int) {
+    stop_requested = 1;
+}
+
+}
+
+// Each worker keeps its own arena warm across the requests it serves
+static void worker(ConnectionQueue& queue, BuildCache& cache) {
+    Arena arena;
+    while (true) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(queue.mutex);
+            queue.ready.wait(lock, [&]() { return queue.closed || !queue.fds.empty(); });
+            if (queue.fds.empty()) return;
+            fd = queue.fds.front();
+            queue.fds.pop_front();
+        }
+
+        std::vector<std::string> request;
+        std::string error;
+        if (!recv_request(fd, request, error)) {
+            if (!error.empty()) {
+                send_string(fd, "") && send_string(fd, "Error: " + error + "\n") && send_string(fd, "1");
+            }
+        } else {
+            std::ostringstream out;
+            std::ostringstream err;
+            int status;
+            try {
+                status = serve(request, arena, cache, out, err);
+            } catch (const std::exception& e) {
+                // A failed request must not take the daemon and its other clients down
+                err << "Error: " << e.what() << std::endl;
+                status = 1;
+            }
+            send_string(fd, out.str()) && send_string(fd, err.str()) &&
+                send_string(fd, std::to_string(status));
+        }
+        close(fd);
+    }
+}
+
+int run_server(const std::string& socket_path) {
+    std::string error;
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr, error)) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+    int probe = connect_socket(socket_path, error);
+    if (probe >= 0) {
+        close(probe);
+        std::cerr << "Error: an mmlc daemon is already listening on " << socket_path << std::endl;
+        return 1;
+    }
+    unlink(socket_path.c_str()); // left behind by a daemon that did not shut down
+
+    // Only this user may connect; connections from other users are also
+    // refused by uid below, in case the socket's directory lets them in
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        chmod(socket_path.c_str(), 0600) != 0 || listen(listener, SOMAXCONN) != 0) {
+        std::cerr << "Error: could not listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    BuildCache cache;
+    if (!cache.open(error)) {
+        std::cerr << "Error: " << error << std::endl;
+        unlink(socket_path.c_str());
+        return 1;
+    }
+
+    // Workers start with the stop signals blocked, so they interrupt accept()
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    ConnectionQueue queue;
+    std::vector<std::thread> workers;
+    unsigned int count = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 0; i < count; i++) {
+        workers.emplace_back(worker, std::ref(queue), std::ref(cache));
+    }
+
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop; // no SA_RESTART: accept() returns EINTR
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
+
+    std::cout << "mmlc daemon listening on " << socket_path << " with " << count << " workers" << std::endl;
+    while (!stop_requested) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        if (!same_user(fd)) {
+            close(fd);
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.fds.push_back(fd);
+        queue.ready.notify_one();
+    }
+
+    close(listener);
+    unlink(socket_path.c_str());
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.closed = true;
+        queue.ready.notify_all();
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+    return 0;
+}
+
+int run_client(const std::string& socket_path, const std::vector<std::string>& args) {
+    std::string error;
+    int fd = connect_socket(socket_path, error);
+    if (fd < 0) {
+        std::cerr << "Error: " << error << std::endl;
+        return 1;
+    }
+    // Another user's daemon could write anything into this directory
+    if (!same_user(fd)) {
+        std::cerr << "Error: the daemon on " << socket_path << " belongs to another user" << std::endl;
+        close(fd);
+        return 1;
+    }
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        std::cerr << "Error: could not read the working directory" << std::endl;
+        close(fd);
+        return 1;
+    }
+    bool ok = send_string(fd, std::to_string(args.size() + 1)) && send_string(fd, cwd);
+    for (size_t i = 0; ok && i < args.size(); i++) {
+        ok = send_string(fd, args[i]);
+    }
+
+    std::string out;
+    std::string err;
+    std::string status;
+    ok = ok && recv_string(fd, out) && recv_string(fd, err) && recv_string(fd, status);
+    close(fd);
+    if (!ok) {
+        std::cerr << "Error: the mmlc daemon on " << socket_path << " closed the connection" << std::endl;
+        return 1;
+    }
+    std::cout << out << std::flush;
+    std::cerr << err << std::flush;
+    return std::atoi(status.c_str());
+}
@@ -1,7 +1,15 @@
 #include "typechecker.h"
-#include <iostream>
+#include <algorithm>
+#include <iterator>
 
-TypeChecker::TypeChecker() : has_errors(false) {}
+static const char* const math_builtins[] = {"sqrt", "exp", "log", "sin", "cos", "abs"};
+
+static bool is_math_builtin(const std::string& name) {
+    return std::find(std::begin(math_builtins), std::end(math_builtins), name) != std::end(math_builtins);
+}
+
+TypeChecker::TypeChecker(Arena& arena, std::ostream& diagnostics)
+    : arena(arena), diagnostics(diagnostics), has_errors(false), declaring(false) {}
 
 bool TypeChecker::check(Program* program) {
     for (ASTNode* stmt : program->statements) {
@@ -16,7 +24,7 @@ Type TypeChecker::check_node(ASTNode* node) {
     switch (node->node_type) {
         case NodeType::VAR_DECL: {
             VarDecl* decl = static_cast<VarDecl*>(node);
-            Type init_type = check_node(decl->initializer);
+            Type init_type = check_expression(decl->initializer);
             
             if (init_type != decl->var_type && init_type != Type::UNKNOWN) {
                 error("Type mismatch in variable declaration '" + decl->name + 
@@ -24,22 +32,30 @@ Type TypeChecker::check_node(ASTNode* node) {
                       ", got " + type_to_string(init_type));
             }
             
-            symbol_table[decl->name] = decl->var_type;
+            symbol_table[decl->name] = {decl->var_type, decl->initializer->shape};
+            return decl->var_type;
+        }
+        
+        case NodeType::INPUT_DECL: {
+            InputDecl* decl = static_cast<InputDecl*>(node);
+            symbol_table[decl->name] = {decl->var_type, decl->shape};
             return decl->var_type;
         }
         
         case NodeType::PRINT_STMT: {
             PrintStmt* stmt = static_cast<PrintStmt*>(node);
-            check_node(stmt->expr);
+            check_expression(stmt->expr);
             return Type::UNKNOWN;
         }
         
+        case NodeType::FN_DECL:
+            check_fn_decl(static_cast<FnDecl*>(node));
+            return Type::UNKNOWN;
+        
+        // Operands are already checked: check_expression visits bottom-up
         case NodeType::BINARY_OP: {
             BinaryOp* binop = static_cast<BinaryOp*>(node);
-            Type left_type = check_node(binop->left);
-            Type right_type = check_node(binop->right);
-            
-            Type result = infer_binary_op(binop->op, left_type, right_type);
+            Type result = infer_binary_op(binop);
             binop->type = result;
             return result;
         }
@@ -51,17 +67,43 @@ Type TypeChecker::check_node(ASTNode* node) {
             return Type::FLOAT;
             
         case NodeType::LITERAL_VEC:
+            node->shape = Shape(static_cast<LiteralVec*>(node)->size, 1);
             return Type::VEC;
             
+        case NodeType::LITERAL_SVEC:
+            node->shape = Shape(static_cast<LiteralSVec*>(node)->size, 1);
+            return Type::SVEC;
+            
+        case NodeType::CALL: {
+            Call* call = static_cast<Call*>(node);
+            Type result = infer_call(call);
+            call->type = result;
+            return result;
+        }
+            
+        case NodeType::SLICE: {
+            Slice* slice = static_cast<Slice*>(node);
+            Type result = infer_slice(slice);
+            slice->type = result;
+            return result;
+        }
+            
+        case NodeType::LITERAL_MAT: {
+            LiteralMat* mat = static_cast<LiteralMat*>(node);
+            mat->shape = Shape(mat->rows, mat->cols);
+            return Type::MAT;
+        }
+            
         case NodeType::IDENTIFIER: {
             Identifier* id = static_cast<Identifier*>(node);
             if (symbol_table.find(id->name) == symbol_table.end()) {
                 error("Undefined variable '" + id->name + "'");
                 return Type::UNKNOWN;
             }
-            Type t = symbol_table[id->name];
-            id->type = t;
-            return t;
+            const Symbol& sym = symbol_table[id->name];
+            id->type = sym.type;
+            id->shape = sym.shape;
+            return sym.type;
         }
         
         default:
@@ -69,8 +111,13 @@ Type TypeChecker::check_node(ASTNode* node) {
     }
 }
 
+Type TypeChecker::check_expression(ASTNode*& expr) {
+    visit_postorder(expr, [this](ASTNode*& node) { check_node(node); });
+    return expr->type;
+}
+
 void TypeChecker::error(const std::string& message) {
-    std::cerr << "Type error: " << message << std::endl;
+    diagnostics << "Type error: " << message << std::endl;
     has_errors = true;
 }
 
@@ -78,7 +125,17 @@ bool TypeChecker::is_numeric(Type t) {
     return t == Type::INT || t == Type::FLOAT;
 }
 
-Type TypeChecker::infer_binary_op(char op, Type left, Type right) {
+Type TypeChecker::infer_binary_op(BinaryOp* node) {
+    char op = node->op;
+    Type left = node->left->type;
+    Type right = node->right->type;
+    const Shape& ls = node->left->shape;
+    const Shape& rs = node->right->shape;
+    
+    if (left == Type::SVEC || right == Type::SVEC) {
+        return infer_sparse_op(node);
+    }
+    
     // Scalar + Scalar
     if (is_numeric(left) && is_numeric(right)) {
         if (left == Type::FLOAT || right == Type::FLOAT) {
@@ -89,16 +146,451 @@ Type TypeChecker::infer_binary_op(char op, Type left, Type right) {
     
     // Vec + Vec
     if (left == Type::VEC && right == Type::VEC) {
+        if (ls.known && rs.known && ls.rows != rs.rows) {
+            error("Vector length mismatch for operator '" + std::string(1, op) +
+                  "': " + shape_to_string(left, ls) + " and " + shape_to_string(right, rs));
+            return Type::UNKNOWN;
+        }
+        node->shape = ls.known ? ls : rs;
         return Type::VEC;
     }
     
     // Vec + Scalar or Scalar + Vec
     if ((left == Type::VEC && is_numeric(right)) || 
         (is_numeric(left) && right == Type::VEC)) {
+        node->shape = left == Type::VEC ? ls : rs;
         return Type::VEC;
     }
     
+    // Mat + Mat, Mat - Mat: elementwise, same shape
+    if (left == Type::MAT && right == Type::MAT && (op == '+' || op == '-')) {
+        if (ls.known && rs.known && (ls.rows != rs.rows || ls.cols != rs.cols)) {
+            error("Matrix shape mismatch for operator '" + std::string(1, op) +
+                  "': " + shape_to_string(left, ls) + " and " + shape_to_string(right, rs));
+            return Type::UNKNOWN;
+        }
+        node->shape = ls.known ? ls : rs;
+        return Type::MAT;
+    }
+    
+    // Mat * Mat: matrix product
+    if (left == Type::MAT && right == Type::MAT && op == '*') {
+        if (ls.known && rs.known && ls.cols != rs.rows) {
+            error("Matrix product needs inner dimensions to agree: " +
+                  shape_to_string(left, ls) + " * " + shape_to_string(right, rs));
+            return Type::UNKNOWN;
+        }
+        if (ls.known && rs.known) {
+            node->shape = Shape(ls.rows, rs.cols);
+        }
+        return Type::MAT;
+    }
+    
+    // Mat * Vec: matrix-vector product
+    if (left == Type::MAT && right == Type::VEC && op == '*') {
+        if (ls.known && rs.known && ls.cols != rs.rows) {
+            error("Matrix-vector product needs matching sizes: " +
+                  shape_to_string(left, ls) + " * " + shape_to_string(right, rs));
+            return Type::UNKNOWN;
+        }
+        if (ls.known) {
+            node->shape = Shape(ls.rows, 1);
+        }
+        return Type::VEC;
+    }
+    
+    // Mat * Scalar or Scalar * Mat
+    if (op == '*' && ((left == Type::MAT && is_numeric(right)) ||
+                      (is_numeric(left) && right == Type::MAT))) {
+        node->shape = left == Type::MAT ? ls : rs;
+        return Type::MAT;
+    }
+    
     error("Invalid operand types for operator '" + std::string(1, op) + 
           "': " + type_to_string(left) + " and " + type_to_string(right));
     return Type::UNKNOWN;
-}
\ No newline at end of file
+}
+
+// Sparse operands: the result stays sparse wherever the operation maps zero
+// to zero (products, scaling, svec +/- svec) and is dense when the other
+// operand fills the gaps (svec +/- vec). Dividing by a sparse vector would
+// divide by its zeros and is rejected.
+Type TypeChecker::infer_sparse_op(BinaryOp* node) {
+    char op = node->op;
+    Type left = node->left->type;
+    Type right = node->right->type;
+    const Shape& ls = node->left->shape;
+    const Shape& rs = node->right->shape;
+    bool left_vector = left == Type::VEC || left == Type::SVEC;
+    bool right_vector = right == Type::VEC || right == Type::SVEC;
+    
+    if (left_vector && right_vector) {
+        if (ls.known && rs.known && ls.rows != rs.rows) {
+            error("Vector length mismatch for operator '" + std::string(1, op) +
+                  "': " + shape_to_string(left, ls) + " and " + shape_to_string(right, rs));
+            return Type::UNKNOWN;
+        }
+        node->shape = ls.known ? ls : rs;
+        if (op == '/' && right == Type::SVEC) {
+            error("Division by svec divides by its zeros; convert it with dense() first");
+            return Type::UNKNOWN;
+        }
+        if (op == '*' || op == '/') {
+            return Type::SVEC;
+        }
+        return left == Type::SVEC && right == Type::SVEC ? Type::SVEC : Type::VEC;
+    }
+    
+    // Svec * Scalar or Scalar * Svec
+    if (op == '*' && ((left == Type::SVEC && is_numeric(right)) ||
+                      (is_numeric(left) && right == Type::SVEC))) {
+        node->shape = left == Type::SVEC ? ls : rs;
+        return Type::SVEC;
+    }
+    
+    // Mat * Svec: matrix-vector product over the non-zeros
+    if (left == Type::MAT && right == Type::SVEC && op == '*') {
+        if (ls.known && rs.known && ls.cols != rs.rows) {
+            error("Matrix-vector product needs matching sizes: " +
+                  shape_to_string(left, ls) + " * " + shape_to_string(right, rs));
+            return Type::UNKNOWN;
+        }
+        if (ls.known) {
+            node->shape = Shape(ls.rows, 1);
+        }
+        return Type::VEC;
+    }
+    
+    if (is_numeric(left) || is_numeric(right)) {
+        error("Operator '" + std::string(1, op) + "' between svec and a scalar would fill " +
+              "every zero; convert with dense() first");
+        return Type::UNKNOWN;
+    }
+    error("Invalid operand types for operator '" + std::string(1, op) +
+          "': " + type_to_string(left) + " and " + type_to_string(right));
+    return Type::UNKNOWN;
+}
+
+// Builtins: dense(svec) -> vec, sparse(vec) -> svec, and the element-wise
+// math functions, which map int/float to float (abs keeps int) and vec to vec
+Type TypeChecker::infer_call(Call* node) {
+    auto fn = functions.find(node->name);
+    if (fn != functions.end()) {
+        return fn->second ? infer_fn_call(node, fn->second) : Type::UNKNOWN;
+    }
+    
+    Type from;
+    Type to;
+    if (is_math_builtin(node->name)) {
+        if (node->args.size() != 1) {
+            error("'" + node->name + "' expects 1 argument, got " + std::to_string(node->args.size()));
+            return Type::UNKNOWN;
+        }
+        ASTNode* arg = node->args[0];
+        node->shape = arg->shape;
+        if (arg->type == Type::VEC) return Type::VEC;
+        if (arg->type == Type::INT && node->name == "abs") return Type::INT;
+        if (is_numeric(arg->type)) return Type::FLOAT;
+        if (arg->type != Type::UNKNOWN) {
+            error("'" + node->name + "' expects int, float or vec, got " + type_to_string(arg->type));
+        }
+        return Type::UNKNOWN;
+    } else if (node->name == "dense") {
+        from = Type::SVEC;
+        to = Type::VEC;
+    } else if (node->name == "sparse") {
+        from = Type::VEC;
+        to = Type::SVEC;
+    } else {
+        error("Unknown function '" + node->name + "'");
+        return Type::UNKNOWN;
+    }
+    
+    if (node->args.size() != 1) {
+        error("'" + node->name + "' expects 1 argument, got " + std::to_string(node->args.size()));
+        return Type::UNKNOWN;
+    }
+    ASTNode* arg = node->args[0];
+    if (arg->type != from) {
+        if (arg->type != Type::UNKNOWN) {
+            error("'" + node->name + "' expects " + type_to_string(from) + ", got " +
+                  type_to_string(arg->type));
+        }
+        return Type::UNKNOWN;
+    }
+    node->shape = arg->shape;
+    return to;
+}
+
+// Each argument binds its parameter: int takes int, float takes int or
+// float, and float and vec take a vec, which makes the call element-wise.
+// Vec arguments must agree in length; unknown lengths are checked at run time.
+Type TypeChecker::infer_fn_call(Call* node, FnDecl* fn) {
+    if (node->args.size() != fn->params.size()) {
+        error("'" + node->name + "' expects " + std::to_string(fn->params.size()) + " argument" +
+              (fn->params.size() == 1 ? "" : "s") + ", got " + std::to_string(node->args.size()));
+        return Type::UNKNOWN;
+    }
+    
+    std::vector<Type> types;
+    Shape length;
+    for (size_t i = 0; i < node->args.size(); i++) {
+        ASTNode* arg = node->args[i];
+        const FnDecl::Param& param = fn->params[i];
+        if (arg->type == Type::UNKNOWN) return Type::UNKNOWN;
+        
+        Type bound = Type::UNKNOWN;
+        if (arg->type == Type::VEC && param.type != Type::INT) {
+            bound = Type::VEC;
+        } else if (arg->type == Type::INT && param.type != Type::VEC) {
+            bound = param.type;
+        } else if (arg->type == Type::FLOAT && param.type == Type::FLOAT) {
+            bound = Type::FLOAT;
+        }
+        if (bound == Type::UNKNOWN) {
+            error("Parameter '" + param.name + "' of '" + fn->name + "' expects " +
+                  type_to_string(param.type) + ", got " + type_to_string(arg->type));
+            return Type::UNKNOWN;
+        }
+        if (bound == Type::VEC && arg->shape.known) {
+            if (length.known && length.rows != arg->shape.rows) {
+                error("Vector length mismatch in call to '" + fn->name + "': " +
+                      shape_to_string(Type::VEC, length) + " and " + shape_to_string(Type::VEC, arg->shape));
+                return Type::UNKNOWN;
+            }
+            length = arg->shape;
+        }
+        types.push_back(bound);
+    }
+    
+    size_t index = 0;
+    ASTNode* body = specialise(fn, types, index);
+    if (!body) return Type::UNKNOWN;
+    node->fn = fn;
+    node->specialisation = index;
+    if (std::find(types.begin(), types.end(), Type::VEC) != types.end()) {
+        node->shape = length;
+        return Type::VEC;
+    }
+    return body->type;
+}
+
+// A fn body may use its parameters, int and float literals, arithmetic,
+// the math builtins and fns declared before it, so every call compiles to
+// one element-wise expression. The body is checked here with the declared
+// parameter types, and again for each new combination of argument types.
+void TypeChecker::check_fn_decl(FnDecl* fn) {
+    bool valid = true;
+    bool named = true;
+    if (is_math_builtin(fn->name) || fn->name == "dense" || fn->name == "sparse") {
+        error("fn '" + fn->name + "' would hide the builtin of that name");
+        named = false;
+    } else if (functions.count(fn->name)) {
+        error("fn '" + fn->name + "' is already declared");
+        named = false;
+    }
+    
+    std::vector<Type> types;
+    for (size_t i = 0; i < fn->params.size(); i++) {
+        const FnDecl::Param& param = fn->params[i];
+        if (param.type != Type::INT && param.type != Type::FLOAT && param.type != Type::VEC) {
+            error("Parameter '" + param.name + "' of fn '" + fn->name + "' must be int, float or vec, got " +
+                  type_to_string(param.type));
+            valid = false;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (fn->params[j].name == param.name) {
+                error("fn '" + fn->name + "' has two parameters named '" + param.name + "'");
+                valid = false;
+            }
+        }
+        types.push_back(param.type);
+    }
+    
+    ASTNode* body = fn->body;
+    visit_postorder(body, [this, fn, &valid](ASTNode*& node) {
+        switch (node->node_type) {
+        case NodeType::LITERAL_INT:
+        case NodeType::LITERAL_FLOAT:
+        case NodeType::BINARY_OP:
+            return;
+        case NodeType::IDENTIFIER: {
+            const std::string& name = static_cast<Identifier*>(node)->name;
+            auto is_param = [&name](const FnDecl::Param& p) { return p.name == name; };
+            if (std::none_of(fn->params.begin(), fn->params.end(), is_param)) {
+                error("fn '" + fn->name + "' can only use its parameters, not '" + name + "'");
+                valid = false;
+            }
+            return;
+        }
+        case NodeType::CALL: {
+            const std::string& name = static_cast<Call*>(node)->name;
+            if (!is_math_builtin(name) && !functions.count(name)) {
+                error("fn '" + fn->name + "' can only call math builtins and fns declared before it, not '" +
+                      name + "'");
+                valid = false;
+            }
+            return;
+        }
+        default:
+            error("Only parameters, int and float literals, arithmetic and calls are allowed in fn '" +
+                  fn->name + "'");
+            valid = false;
+            return;
+        }
+    });
+    
+    if (valid) {
+        size_t index = 0;
+        declaring = true;
+        valid = specialise(fn, types, index) != nullptr;
+        declaring = false;
+    }
+    if (named) {
+        functions[fn->name] = valid ? fn : nullptr;
+    }
+}
+
+// Types a copy of fn's body with its parameters bound to types. Calls keep
+// the copy as a specialisation, shared by every call with the same types.
+ASTNode* TypeChecker::specialise(FnDecl* fn, const std::vector<Type>& types, size_t& index) {
+    for (size_t k = 0; k < fn->specialisations.size(); k++) {
+        if (fn->specialisations[k].types == types) {
+            index = k;
+            return fn->specialisations[k].body;
+        }
+    }
+    
+    ASTNode* body = copy_body(fn->body);
+    std::unordered_map<std::string, Symbol> scope;
+    for (size_t i = 0; i < fn->params.size(); i++) {
+        scope[fn->params[i].name] = {types[i], Shape()};
+    }
+    std::swap(scope, symbol_table);
+    bool had_errors = has_errors;
+    has_errors = false;
+    check_expression(body);
+    bool failed = has_errors;
+    has_errors = had_errors || failed;
+    std::swap(scope, symbol_table);
+    
+    if (failed) {
+        std::string signature;
+        for (size_t i = 0; i < types.size(); i++) {
+            signature += (i ? ", " : "") + type_to_string(types[i]);
+        }
+        error(declaring ? "in the body of fn '" + fn->name + "'"
+                        : "in fn '" + fn->name + "' called with (" + signature + ")");
+        return nullptr;
+    }
+    if (!declaring) {
+        bool elementwise = std::find(types.begin(), types.end(), Type::VEC) != types.end();
+        index = fn->specialisations.size();
+        fn->specialisations.push_back({types, body, elementwise});
+    }
+    return body;
+}
+
+// Fresh nodes for a fn body, which holds only the node kinds
+// check_fn_decl allows
+ASTNode* TypeChecker::copy_body(ASTNode* body) {
+    std::vector<ASTNode*> copies;
+    visit_postorder(body, [this, &copies](ASTNode*& node) {
+        ASTNode* copy = node;
+        switch (node->node_type) {
+        case NodeType::LITERAL_INT:
+            copy = arena.create<LiteralInt>(static_cast<LiteralInt*>(node)->value);
+            break;
+        case NodeType::LITERAL_FLOAT:
+            copy = arena.create<LiteralFloat>(static_cast<LiteralFloat*>(node)->value);
+            break;
+        case NodeType::IDENTIFIER:
+            copy = arena.create<Identifier>(static_cast<Identifier*>(node)->name);
+            break;
+        case NodeType::BINARY_OP: {
+            ASTNode* right = copies.back();
+            copies.pop_back();
+            ASTNode* left = copies.back();
+            copies.pop_back();
+            copy = arena.create<BinaryOp>(static_cast<BinaryOp*>(node)->op, left, right);
+            break;
+        }
+        case NodeType::CALL: {
+            size_t argc = static_cast<Call*>(node)->args.size();
+            std::vector<ASTNode*> args(copies.end() - argc, copies.end());
+            copies.resize(copies.size() - argc);
+            copy = arena.create<Call>(static_cast<Call*>(node)->name, std::move(args));
+            break;
+        }
+        default:
+            break;
+        }
+        copy->line = node->line;
+        copies.push_back(copy);
+    });
+    return copies.back();
+}
+
+// vec[start:stop:step] with int bounds. The length of the view is known
+// when every bound is a literal (or omitted, with a known vec length); if
+// the vec length is known too the bounds are checked here and the slice
+// needs no run-time check, otherwise the generated code checks them.
+Type TypeChecker::infer_slice(Slice* node) {
+    Type vec = node->vec->type;
+    if (vec != Type::VEC) {
+        if (vec != Type::UNKNOWN) {
+            error("Only vec values can be sliced, got " + type_to_string(vec));
+        }
+        return Type::UNKNOWN;
+    }
+    
+    const Shape& vs = node->vec->shape;
+    ASTNode* bounds[3] = {node->start, node->stop, node->step};
+    static const char* const names[3] = {"start", "stop", "step"};
+    long long value[3] = {0, static_cast<long long>(vs.rows), 1};
+    bool literal = node->stop || vs.known;
+    for (int i = 0; i < 3; i++) {
+        if (!bounds[i]) continue;
+        if (bounds[i]->type != Type::INT) {
+            if (bounds[i]->type != Type::UNKNOWN) {
+                error(std::string("Slice ") + names[i] + " must be int, got " +
+                      type_to_string(bounds[i]->type));
+            }
+            return Type::UNKNOWN;
+        }
+        if (bounds[i]->node_type == NodeType::LITERAL_INT) {
+            value[i] = static_cast<LiteralInt*>(bounds[i])->value;
+        } else {
+            literal = false;
+        }
+    }
+    
+    if (node->step && node->step->node_type == NodeType::LITERAL_INT && value[2] < 1) {
+        error("Slice step must be at least 1, got " + std::to_string(value[2]));
+        return Type::UNKNOWN;
+    }
+    if (!literal) {
+        return Type::VEC;
+    }
+    
+    std::string text = "[" + std::to_string(value[0]) + ":" + std::to_string(value[1]) +
+                       (node->step ? ":" + std::to_string(value[2]) : "") + "]";
+    if (value[0] < 0 || value[0] > value[1]) {
+        error("Slice " + text + " needs 0 <= start <= stop");
+        return Type::UNKNOWN;
+    }
+    if (vs.known && static_cast<size_t>(value[1]) > vs.rows) {
+        error("Slice " + text + " out of range for " + shape_to_string(vec, vs));
+        return Type::UNKNOWN;
+    }
+    
+    size_t count = static_cast<size_t>((value[1] - value[0] + value[2] - 1) / value[2]);
+    node->shape = Shape(count, 1);
+    if (vs.known) {
+        node->static_bounds = true;
+        node->first = static_cast<size_t>(value[0]);
+        node->count = count;
+        node->stride = static_cast<size_t>(value[2]);
+    }
+    return Type::VEC;
+}
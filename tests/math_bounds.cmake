@@ -0,0 +1,75 @@
+# Checks the error bounds of the math builtins. Every row below must appear
+# both in the README's table and in the comment mmlc emits above the math
+# runtime, and rows with ranges are measured by tests/math_bounds.cpp, built
+# with the backend's flags against the runtime that mmlc generates for
+# tests/math_bounds.mml. Inputs: MMLC, CXX, SOURCE_DIR (tests/), README, WORK_DIR.
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+execute_process(COMMAND ${MMLC} --print-pipeline --backend-cc=true ${SOURCE_DIR}/math_bounds.mml
+                WORKING_DIRECTORY ${WORK_DIR}
+                RESULT_VARIABLE status OUTPUT_VARIABLE log ERROR_VARIABLE errors)
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "mmlc ${SOURCE_DIR}/math_bounds.mml failed:\n${log}${errors}")
+endif()
+if(NOT log MATCHES "Backend: [^ ]+ ([^\n]*) -o output output.cpp")
+    message(FATAL_ERROR "no backend command in mmlc's output:\n${log}")
+endif()
+separate_arguments(backend_flags UNIX_COMMAND "${CMAKE_MATCH_1}")
+
+execute_process(COMMAND ${CXX} ${backend_flags} -I${WORK_DIR} -o math_bounds ${SOURCE_DIR}/math_bounds.cpp
+                WORKING_DIRECTORY ${WORK_DIR}
+                RESULT_VARIABLE status OUTPUT_VARIABLE errors ERROR_VARIABLE errors)
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "building math_bounds failed:\n${errors}")
+endif()
+
+# The emitted comment's rows, with their columns joined by " | "
+file(STRINGS ${WORK_DIR}/output.cpp comment REGEX "^//   mml_")
+string(REPLACE "//   " "" comment "${comment}")
+string(REGEX REPLACE "  +" " | " comment "${comment}")
+file(READ ${README} readme)
+
+# functions: comma-separated names; range and bound: the table's text;
+# then the bound's kind (ulp or abs), its limit and the [lo, hi] ranges
+# to sweep, if it is measured
+function(check_row functions range bound)
+    string(REPLACE "," ";" names "${functions}")
+    set(readme_names "")
+    set(comment_names "")
+    foreach(name IN LISTS names)
+        list(APPEND readme_names "`${name}`")
+        list(APPEND comment_names "mml_${name}")
+    endforeach()
+    list(JOIN readme_names ", " readme_names)
+    list(JOIN comment_names ", " comment_names)
+    string(REPLACE "|" "\\|" readme_range "${range}")
+
+    string(FIND "${readme}" "| ${readme_names} | ${readme_range} | ${bound}" found)
+    if(found EQUAL -1)
+        message(FATAL_ERROR "README has no row '${readme_names} | ${readme_range} | ${bound}'")
+    endif()
+    string(FIND "${comment}" "${comment_names} | ${range} | ${bound}" found)
+    if(found EQUAL -1)
+        message(FATAL_ERROR "the emitted math comment has no row "
+                            "'${comment_names}  ${range}  ${bound}':\n${comment}")
+    endif()
+
+    if(ARGC GREATER 3)
+        foreach(name IN LISTS names)
+            execute_process(COMMAND ${WORK_DIR}/math_bounds ${name} ${ARGN}
+                            RESULT_VARIABLE status OUTPUT_VARIABLE measured ERROR_VARIABLE measured)
+            message(STATUS "${measured}")
+            if(NOT status EQUAL 0)
+                message(FATAL_ERROR "${name} on ${range} exceeds ${bound}")
+            endif()
+        endforeach()
+    endif()
+endfunction()
+
+check_row("exp" "[-87.3, 88.7]" "1.1 ulp" ulp 1.1 -87.3 88.7)
+check_row("log" "x > 0, including subnormals" "1 ulp" ulp 1 0 3.4028235e38)
+check_row("sin,cos" "|x| <= 64" "2.5 ulp" ulp 2.5 -64 64)
+check_row("sin,cos" "64 < |x| <= 8192" "absolute error below 1e-7" abs 1e-7 -8192 -64 64 8192)
+check_row("sin,cos" "larger |x|, NaN" "computed with libm")
+check_row("sqrt,abs" "all" "exact")
@@ -0,0 +1,87 @@
+// Measures the generated math runtime against double-precision libm.
+// Built by tests/math_bounds.cmake against a program's output.cpp; usage:
+//   math_bounds <function> <ulp|abs> <limit> <lo> <hi> [<lo> <hi> ...]
+// sweeps every step-th float of each [lo, hi] and fails if the error
+// exceeds limit.
+#define main mml_generated_main
+#include "output.cpp"
+#undef main
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+namespace {
+
+const uint64_t step = 1009;
+
+// Maps floats to integers in the same order, so a range can be swept by
+// stepping through its bit patterns
+uint64_t ordered(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof bits);
+    return (bits & 0x80000000u) ? 0x80000000u - (bits & 0x7fffffffu) : 0x80000000u + bits;
+}
+
+float from_ordered(uint64_t key) {
+    uint32_t bits = key >= 0x80000000u ? uint32_t(key - 0x80000000u)
+                                       : 0x80000000u | uint32_t(0x80000000u - key);
+    float x;
+    std::memcpy(&x, &bits, sizeof x);
+    return x;
+}
+
+// Error in units of the last place of the reference rounded to float
+double ulp_error(float got, double ref) {
+    if (std::isnan(got) && std::isnan(ref)) return 0;
+    if (std::isinf(ref)) return got == float(ref) ? 0 : INFINITY;
+    float rounded = std::fabs(float(ref));
+    double ulp = rounded == 0 ? std::nextafter(0.0f, 1.0f)
+                              : std::nextafter(rounded, INFINITY) - rounded;
+    return std::fabs(got - ref) / ulp;
+}
+
+bool lookup(const std::string& name, float (*&fn)(float), double (*&ref)(double)) {
+    if (name == "exp") { fn = mml_exp; ref = [](double x) { return std::exp(x); }; }
+    else if (name == "log") { fn = mml_log; ref = [](double x) { return std::log(x); }; }
+    else if (name == "sin") { fn = mml_sin; ref = [](double x) { return std::sin(x); }; }
+    else if (name == "cos") { fn = mml_cos; ref = [](double x) { return std::cos(x); }; }
+    else return false;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    float (*fn)(float);
+    double (*ref)(double);
+    if (argc < 6 || argc % 2 != 0 || !lookup(argv[1], fn, ref)) {
+        std::fprintf(stderr, "usage: %s exp|log|sin|cos ulp|abs <limit> <lo> <hi> [<lo> <hi> ...]\n", argv[0]);
+        return 2;
+    }
+    bool absolute = std::string(argv[2]) == "abs";
+    double limit = std::atof(argv[3]);
+
+    double worst = 0;
+    float worst_at = 0;
+    for (int i = 4; i < argc; i += 2) {
+        uint64_t last = ordered(std::strtof(argv[i + 1], nullptr));
+        for (uint64_t key = ordered(std::strtof(argv[i], nullptr)); key <= last; key += step) {
+            float x = from_ordered(key);
+            double expected = ref(x);
+            float got = fn(x);
+            double error = absolute ? std::fabs(got - expected) : ulp_error(got, expected);
+            if (!(error <= worst)) {
+                worst = error;
+                worst_at = x;
+            }
+        }
+    }
+
+    std::printf("%s: max %s error %g at %a (bound %g)\n", argv[1], absolute ? "absolute" : "ulp",
+                worst, worst_at, limit);
+    return worst <= limit ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+# Compiles SOURCE with MMLC and FLAGS in WORK_DIR and runs the program in
+# the directory of SOURCE with ARGS. The check files, each optional:
+#  - EXPECTED: what the program prints on stdout
+#  - ERROR: compiling or running must fail, printing this text on stderr
+#  - LOG: one regular expression per line that mmlc's output must match
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+separate_arguments(FLAGS)
+separate_arguments(ARGS)
+get_filename_component(SOURCE_DIR ${SOURCE} DIRECTORY)
+
+if(ERROR)
+    file(READ ${ERROR} error_text)
+    string(STRIP "${error_text}" error_text)
+endif()
+
+execute_process(COMMAND ${MMLC} ${FLAGS} ${SOURCE}
+                WORKING_DIRECTORY ${WORK_DIR}
+                RESULT_VARIABLE status OUTPUT_VARIABLE log ERROR_VARIABLE errors)
+if(NOT status EQUAL 0)
+    if(DEFINED error_text)
+        string(FIND "${errors}" "${error_text}" found)
+        if(found EQUAL -1)
+            message(FATAL_ERROR "mmlc ${FLAGS} ${SOURCE} failed without '${error_text}':\n${errors}")
+        endif()
+        return()
+    endif()
+    message(FATAL_ERROR "mmlc ${FLAGS} ${SOURCE} failed:\n${log}${errors}")
+endif()
+
+if(LOG)
+    file(STRINGS ${LOG} patterns)
+    foreach(pattern IN LISTS patterns)
+        if(NOT log MATCHES "${pattern}")
+            message(FATAL_ERROR "mmlc ${FLAGS} ${SOURCE} printed nothing matching '${pattern}':\n${log}")
+        endif()
+    endforeach()
+endif()
+
+execute_process(COMMAND ${WORK_DIR}/output ${ARGS}
+                WORKING_DIRECTORY ${SOURCE_DIR}
+                RESULT_VARIABLE status OUTPUT_VARIABLE actual ERROR_VARIABLE errors)
+if(DEFINED error_text)
+    string(FIND "${errors}" "${error_text}" found)
+    if(status EQUAL 0 OR found EQUAL -1)
+        message(FATAL_ERROR "${SOURCE} (${FLAGS}) was expected to fail with '${error_text}'; "
+                            "exit status ${status}, stderr:\n${errors}")
+    endif()
+elseif(NOT status EQUAL 0)
+    message(FATAL_ERROR "${SOURCE} (${FLAGS}) exited with status ${status}:\n${errors}")
+endif()
+
+if(EXPECTED)
+    file(READ ${EXPECTED} expected)
+    if(NOT actual STREQUAL expected)
+        message(FATAL_ERROR "output of ${SOURCE} (${FLAGS}):\n${actual}\nexpected:\n${expected}")
+    endif()
+endif()